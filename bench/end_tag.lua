@@ -0,0 +1,100 @@
+-- Compares ways to keep per-element state until the end tag on a deeply
+-- nested document: the workaround without end tag handlers (a Lua stack of
+-- open elements, popped when the sink sees a marker inserted after each end
+-- tag), and an integer or a table stored as the element user value. Each
+-- variant computes the number of descendants of every div.
+--   lua bench/end_tag.lua [iterations] [depth]
+
+local lolhtml = require "lolhtml"
+
+local iterations = tonumber(arg[1]) or 200
+local depth = tonumber(arg[2]) or 50
+
+local page do
+  local parts = { "<html><body>" }
+  for i=1, 40 do
+    for d=1, depth do
+      parts[#parts+1] = string.format('<div class="d%d"><span>%d</span>', d, i)
+    end
+    parts[#parts+1] = string.rep("</div>", depth)
+  end
+  parts[#parts+1] = "</body></html>"
+  page = table.concat(parts)
+end
+
+local div = lolhtml.new_selector("div")
+local opened, total = 0, 0
+
+local variants = {
+  { "sink markers", function(sink)
+    local stack, n = {}, 0
+    local marker = "<!--/div-->"
+    local pattern = marker:gsub("%-", "%%-")
+    -- the marker is output right after the end tag, the sink pops the stack
+    -- and strips it
+    sink.fn = function(chunk)
+      local s = chunk:find(marker, 1, true)
+      if not s then return end
+      repeat
+        total = total + opened - stack[n]
+        n = n - 1
+        s = chunk:find(marker, s + #marker, true)
+      until not s
+      -- a real sink would forward this
+      chunk:gsub(pattern, "")
+    end
+    return lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = div,
+        element_handler = function(el)
+          opened = opened + 1
+          n = n + 1
+          stack[n] = opened
+          el:after(marker, true)
+        end,
+      }
+  end },
+  { "end tag, integer", function()
+    return lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = div,
+        element_handler = function(el)
+          opened = opened + 1
+          el:set_user_value(opened)
+        end,
+        end_tag_handler = function(_, start) total = total + opened - start end,
+      }
+  end },
+  { "end tag, table", function()
+    return lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = div,
+        element_handler = function(el)
+          opened = opened + 1
+          el:set_user_value({ start = opened })
+        end,
+        end_tag_handler = function(_, t) total = total + opened - t.start end,
+      }
+  end },
+}
+
+local expected
+for _, variant in ipairs(variants) do
+  local name, new_builder = variant[1], variant[2]
+  local sink = { fn = function() end }
+  local builder = new_builder(sink)
+  local rewriter = lolhtml.new_rewriter { builder=builder, sink=sink.fn }
+  collectgarbage("collect")
+  local start = os.clock()
+  for _=1, iterations do
+    opened, total = 0, 0
+    assert(rewriter:reset())
+    assert(rewriter:write(page))
+    assert(rewriter:close())
+  end
+  local elapsed = os.clock() - start
+  expected = expected or total
+  assert(total == expected, name .. ": wrong result")
+  print(string.format("%-18s %.2f MB/s, %.0f elements/s", name,
+    #page * iterations / elapsed / 1e6, opened * iterations / elapsed))
+end
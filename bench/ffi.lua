@@ -0,0 +1,50 @@
+-- Compares the C module with the FFI binding (lolhtml.ffi) on the same
+-- handler-heavy builder. Must be run with LuaJIT:
+--   luajit bench/ffi.lua [iterations]
+
+local iterations = tonumber(arg[1]) or 2000
+
+local page do
+  local parts = { "<!DOCTYPE html><html><body>" }
+  for i=1, 500 do
+    parts[#parts+1] = string.format('<p><!-- %d --><a href="/%d">link %d</a> text</p>', i, i, i)
+  end
+  parts[#parts+1] = "</body></html>"
+  page = table.concat(parts)
+end
+
+local function run(name, lolhtml)
+  local callbacks = 0
+  local builder = lolhtml.new_rewriter_builder()
+    :add_document_content_handlers {
+      comment_handler = function(c) callbacks = callbacks + 1 end,
+      text_handler = function(t) callbacks = callbacks + 1 end,
+    }
+    :add_element_content_handlers {
+      selector = lolhtml.new_selector("a"),
+      element_handler = function(el)
+        callbacks = callbacks + 1
+        el:set_attribute("href", el:get_attribute("href") .. "?x")
+      end,
+    }
+
+  local size = 0
+  local rewriter = lolhtml.new_rewriter {
+    builder = builder,
+    sink = function(chunk) size = size + #chunk end,
+  }
+
+  collectgarbage("collect")
+  local start = os.clock()
+  for _=1, iterations do
+    assert(rewriter:reset())
+    assert(rewriter:write(page))
+    assert(rewriter:close())
+  end
+  local elapsed = os.clock() - start
+  print(string.format("%s: %.2f MB/s, %.0f callbacks/s (%d bytes out)", name,
+    #page * iterations / elapsed / 1e6, callbacks / elapsed, size / iterations))
+end
+
+run("C module", require "lolhtml")
+run("FFI", require "lolhtml.ffi")
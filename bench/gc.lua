@@ -0,0 +1,57 @@
+-- Measures the GC pauses with many live rewriters and a constant churn of
+-- short-lived ones, as in a server handling many concurrent documents. With
+-- Lua 5.4 the rewriters don't allocate a uservalue table, so there are fewer
+-- objects to traverse. Compare the results of the same build with both
+-- versions, and the two collectors of Lua 5.4:
+--   lua5.3 bench/gc.lua [iterations] [live]
+--   lua5.4 bench/gc.lua [iterations] [live] [incremental|generational]
+
+local lolhtml = require "lolhtml"
+
+local iterations = tonumber(arg[1]) or 100000
+local live = tonumber(arg[2]) or 5000
+if arg[3] then
+  assert(_VERSION == "Lua 5.4", "the GC mode can only be chosen with Lua 5.4")
+  collectgarbage(arg[3])
+end
+
+local page = '<html><body><p><a href="/">link</a> text</p></body></html>'
+
+local builder = lolhtml.new_rewriter_builder()
+  :add_element_content_handlers {
+    selector = lolhtml.new_selector("a[href]"),
+    element_handler = function(el, ctx) ctx.links = ctx.links + 1 end,
+  }
+
+local function sink() end
+
+-- long-lived rewriters, kept between documents
+local pool = {}
+for i=1, live do
+  pool[i] = lolhtml.new_rewriter { builder=builder, sink=sink, context={ links=0 } }
+end
+
+local times = {}
+collectgarbage("collect")
+local start = os.clock()
+for i=1, iterations do
+  local t = os.clock()
+  local rewriter = lolhtml.new_rewriter { builder=builder, sink=sink, context={ links=0 } }
+  assert(rewriter:write(page))
+  assert(rewriter:close())
+  local slot = i % live + 1
+  assert(pool[slot]:reset { context={ links=0 } })
+  times[i] = os.clock() - t
+end
+local elapsed = os.clock() - start
+
+table.sort(times)
+local function pct(p) return times[math.floor(p * (iterations - 1)) + 1] * 1e6 end
+print(string.format("%s (%s): %.0f documents/s", _VERSION, arg[3] or "default", iterations / elapsed))
+print(string.format("iteration time (µs): p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f",
+  pct(0.5), pct(0.99), pct(0.999), times[iterations] * 1e6))
+
+start = os.clock()
+collectgarbage("collect")
+print(string.format("full collection with %d live rewriters: %.2f ms, %.0f KB",
+  live, (os.clock() - start) * 1e3, collectgarbage("count")))
@@ -0,0 +1,56 @@
+-- Measures how many rewriters per second can be set up and run on small pages,
+-- where the setup cost dominates. Compares creating a new rewriter for each
+-- document with resetting a single one.
+--
+-- Run it like this:
+--   lua bench/rewriter_setup.lua [iterations]
+
+local lolhtml = require "lolhtml"
+
+local iterations = tonumber(arg[1]) or 20000
+
+-- build a ~2KB page
+local page do
+  local parts = { "<!DOCTYPE html><html><head><title>bench</title></head><body>" }
+  while #table.concat(parts) < 2000 do
+    table.insert(parts, '<p class="item"><a href="http://example.com/">link</a> some text</p>')
+  end
+  table.insert(parts, "</body></html>")
+  page = table.concat(parts)
+end
+
+local builder = lolhtml.new_rewriter_builder()
+  :add_element_content_handlers {
+    selector = lolhtml.new_selector("a[href]"),
+    element_handler = function(el, ctx) ctx.links = ctx.links + 1 end,
+  }
+
+local function sink() end
+
+local function run(name, f)
+  collectgarbage("collect")
+  local start = os.clock()
+  f()
+  local elapsed = os.clock() - start
+  print(string.format("%-10s %8d docs of %d bytes in %.3fs: %10.0f rewriters/s",
+    name, iterations, #page, elapsed, iterations / elapsed))
+end
+
+run("new", function()
+  for _=1, iterations do
+    local ctx = { links = 0 }
+    local rewriter = lolhtml.new_rewriter { builder=builder, sink=sink, context=ctx }
+    assert(rewriter:write(page))
+    assert(rewriter:close())
+  end
+end)
+
+run("reset", function()
+  local rewriter = lolhtml.new_rewriter { builder=builder, sink=sink }
+  for _=1, iterations do
+    local ctx = { links = 0 }
+    assert(rewriter:reset { context=ctx })
+    assert(rewriter:write(page))
+    assert(rewriter:close())
+  end
+end)
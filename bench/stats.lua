@@ -0,0 +1,56 @@
+-- Measures the rewriting throughput with a handler-heavy builder, and the
+-- cost of reading the counters with Rewriter:stats().
+--
+-- The counters are always maintained, to measure their overhead compare the
+-- results with a build without them:
+--   make clean && make CFLAGS=-DLOLHTML_NO_STATS
+--
+-- Run it like this:
+--   lua bench/stats.lua [iterations]
+
+local lolhtml = require "lolhtml"
+
+local iterations = tonumber(arg[1]) or 2000
+
+local page do
+  local parts = { "<!DOCTYPE html><html><body>" }
+  for i=1, 500 do
+    parts[#parts+1] = string.format('<p><!-- %d --><a href="/%d">link %d</a> text</p>', i, i, i)
+  end
+  parts[#parts+1] = "</body></html>"
+  page = table.concat(parts)
+end
+
+local builder = lolhtml.new_rewriter_builder()
+  :add_document_content_handlers {
+    comment_handler = function() end,
+    text_handler = function() end,
+  }
+  :add_element_content_handlers {
+    selector = lolhtml.new_selector("a"),
+    element_handler = function() end,
+  }
+
+local rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+local stats = {}
+local callbacks = 0
+
+collectgarbage("collect")
+local start = os.clock()
+for _=1, iterations do
+  assert(rewriter:reset())
+  assert(rewriter:write(page))
+  assert(rewriter:close())
+  callbacks = callbacks + rewriter:stats(stats).callbacks
+end
+local elapsed = os.clock() - start
+print(string.format("rewrite: %.2f MB/s, %.0f callbacks/s (%d callbacks per document)",
+  #page * iterations / elapsed / 1e6, callbacks / elapsed, callbacks / iterations))
+
+local n = iterations * 100
+start = os.clock()
+for _=1, n do
+  rewriter:stats(stats)
+end
+elapsed = os.clock() - start
+print(string.format("stats(t): %.0f ns per call", elapsed / n * 1e9))
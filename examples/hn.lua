@@ -7,30 +7,27 @@
 
 local lolhtml = require "lolhtml"
 
--- This table will hold all our links
-local links = {}
-
--- this variable will store the currently parsed link as the content extraction
--- will span across different callbacks
--- Note that `links[#links]` should be equivalent.
-local current_link
-
+-- The builder doesn't hold any state: everything related to the document
+-- being parsed lives in the context object given to the rewriter and passed
+-- to every handler. This way the same builder could be reused for any number
+-- of documents.
 local builder = lolhtml.new_rewriter_builder()
   :add_element_content_handlers {
     selector = lolhtml.new_selector "a.storylink",
-    element_handler = function(el)
+    element_handler = function(el, ctx)
       -- This is called right after parsing the opening anchor: create a new
       -- link table and grab the target. the `tmp` filed will be used as an
       -- accumulator
-      current_link = { href = el:get_attribute("href"), tmp = {} }
-      table.insert(links, current_link)
+      ctx.current_link = { href = el:get_attribute("href"), tmp = {} }
+      table.insert(ctx.links, ctx.current_link)
     end,
-    text_handler = function(t)
+    text_handler = function(t, ctx)
       -- Grabbing text is a bit more involved than attributes as the callback
       -- might be called an arbitrary number of times (depending how the text
       -- is fed into the parser.
       -- Here we use the accumulator to keep the whole text nutil the anchor
       -- tag is closed.
+      local current_link = ctx.current_link
       table.insert(current_link.tmp, t:get_text())
 
       if t:is_last_in_text_node() then
@@ -44,10 +41,11 @@ local builder = lolhtml.new_rewriter_builder()
   -- grab the score: we need another selector for that
   :add_element_content_handlers {
     selector = lolhtml.new_selector "span.score",
-    text_handler = function(t)
+    text_handler = function(t, ctx)
       -- This callback is called after the above one (as long as the page
       -- structure doesn't change. So we should have a current_link object.
       -- Apply the same accumulator technique as above.
+      local current_link = ctx.current_link
       table.insert(current_link.tmp, t:get_text())
 
       if t:is_last_in_text_node() then
@@ -60,8 +58,14 @@ local builder = lolhtml.new_rewriter_builder()
     end
   }
 
+-- This table will hold all our links, `current_link` will store the currently
+-- parsed link as the content extraction will span across different callbacks
+-- Note that `links[#links]` should be equivalent.
+local ctx = { links = {}, current_link = nil }
+
 local rewriter = lolhtml.new_rewriter {
   builder = builder,
+  context = ctx,
   -- here we don't care about the output, just throw it away
   sink = function() end,
 }
@@ -73,6 +77,6 @@ while true do
 end
 assert(rewriter:close())
 
-for _, l in ipairs(links) do
+for _, l in ipairs(ctx.links) do
   io.stdout:write(string.format("%s\n\tpoints: %d\n\tlink: %s\n", l.text, l.points, l.href))
 end
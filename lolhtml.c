@@ -1,13 +1,124 @@
+#define _GNU_SOURCE /* memmem */
 #include <lua.h>
 #include <lauxlib.h>
 #include <compat-5.3.h>
 #include <lol_html.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
 #include <assert.h>
+#include <unistd.h>
+
+/* USDT probes for bpftrace/perf, they are only a nop instruction when not
+ * traced. They are enabled when sys/sdt.h (systemtap-sdt-dev) is available,
+ * unless LOLHTML_NO_USDT is defined. */
+#if !defined(LOLHTML_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LOLHTML_USDT 1
+#endif
+#endif
+
+#ifdef LOLHTML_USDT
+#define PROBE1(name, a) DTRACE_PROBE1(lolhtml, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(lolhtml, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(lolhtml, name, a, b, c)
+#else
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
+
+/* Allocation accounting (LOLHTML_ALLOC_HOOK): the shared object is linked with
+ * `--wrap` for the libc allocation functions (see the Makefile), so all the
+ * native allocations of the module, including the ones made by lol-html, go
+ * through the hooks below. They keep a process-wide total (a plain
+ * statistic) and a per-thread delta that is credited to the Lua state calling
+ * into the module, see native_sync. Allocations made inside libc (e.g. by
+ * strdup) are not wrapped, so the module must not free them. */
+#ifdef LOLHTML_ALLOC_HOOK
+#include <malloc.h>
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+static atomic_llong native_bytes_process;
+static _Thread_local long long native_bytes_delta;
+
+static inline void native_account(long long n) {
+    atomic_fetch_add_explicit(&native_bytes_process, n, memory_order_relaxed);
+    native_bytes_delta += n;
+}
+
+void *__wrap_malloc(size_t size) {
+    void *p = __real_malloc(size);
+    if (p != NULL) {
+        native_account(malloc_usable_size(p));
+    }
+    return p;
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    void *p = __real_calloc(nmemb, size);
+    if (p != NULL) {
+        native_account(malloc_usable_size(p));
+    }
+    return p;
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    long long old = ptr != NULL ? (long long)malloc_usable_size(ptr) : 0;
+    void *p = __real_realloc(ptr, size);
+    if (p != NULL) {
+        native_account((long long)malloc_usable_size(p) - old);
+    } else if (size == 0) {
+        native_account(-old); /* freed */
+    }
+    return p;
+}
+
+void __wrap_free(void *ptr) {
+    if (ptr != NULL) {
+        native_account(-(long long)malloc_usable_size(ptr));
+    }
+    __real_free(ptr);
+}
+
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size) {
+    int rc = __real_posix_memalign(memptr, alignment, size);
+    if (rc == 0) {
+        native_account(malloc_usable_size(*memptr));
+    }
+    return rc;
+}
+#endif
+
+/* strdup allocates inside libc, bypassing the allocation hooks */
+static char *copy_string(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = malloc(len);
+    if (copy != NULL) {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
 
 #define PREFIX "lolhtml."
 
+/* Note: besides the shared templates (protected by a mutex) and the
+ * allocation statistics (atomic), everything is attached to the registry of
+ * the lua_State the module is loaded into. Independent states can be used
+ * concurrently from different threads (but a single state must not be shared
+ * between threads, as usual with Lua). */
+
 /* VM registry name for a module wide sub-registry used to keep references to
  * actual objects using `luaL_ref` in case where we need to retrieve Lua objects
  * from callbacks.
@@ -15,18 +126,385 @@
  */
 #define LOL_REGISTRY (PREFIX "weakreg")
 
-/* rewriter uservalue indices */
-/* note: for now the uservalue is a Lua table with numeric indices, but Lua 5.4
- * allows multiple user values, that should be more efficient */
+/* rewriter user values indices: with Lua 5.4 they are stored in the user values
+ * of the userdata, older versions use a table as uservalue. They are accessed
+ * with get_rewriter_value and set_rewriter_value. */
+#define REWRITER_USER_VALUES 7
 #define REWRITER_CALLBACK_INDEX 1
 #define REWRITER_BUILDER_INDEX 2
 #define REWRITER_ERROR_INDEX 3
+#define REWRITER_CONTEXT_INDEX 4
+#define REWRITER_ENCODING_INDEX 5
+#define REWRITER_CAPTURE_INDEX 6
+#define REWRITER_VALUES_INDEX 7
+
+/* content handler types, used to index per-type data */
+enum {
+    HANDLER_DOCTYPE,
+    HANDLER_COMMENT,
+    HANDLER_TEXT,
+    HANDLER_DOC_END,
+    HANDLER_ELEMENT,
+    HANDLER_END_TAG,
+    HANDLER_TYPES_COUNT
+};
+
+/* metatables of the objects passed to the handlers, by handler type */
+static const char *const handler_param_types[HANDLER_TYPES_COUNT] = {
+    PREFIX "doctype", PREFIX "comment", PREFIX "text_chunk", PREFIX "doc_end", PREFIX "element",
+    PREFIX "end_tag"
+};
+
+/* names used to report per-type data to Lua */
+static const char *const handler_type_names[HANDLER_TYPES_COUNT] = {
+    "doctype", "comment", "text", "doc_end", "element", "end_tag"
+};
+
+/* fields used to report per-type callback counts */
+static const char *const handler_stat_fields[HANDLER_TYPES_COUNT] = {
+    "doctype_callbacks", "comment_callbacks", "text_callbacks", "doc_end_callbacks", "element_callbacks",
+    "end_tag_callbacks"
+};
+
+/* Counters can be disabled at compile time with LOLHTML_NO_STATS, mostly to
+ * measure their overhead. */
+#ifdef LOLHTML_NO_STATS
+#define STAT_ADD(rewriter, field, n) ((void)0)
+#else
+#define STAT_ADD(rewriter, field, n) ((rewriter)->stats.field += (n))
+#endif
+
+typedef struct {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t writes;
+    uint64_t sink_calls;
+    uint64_t callbacks[HANDLER_TYPES_COUNT];
+} rewriter_stats_t;
+
+/* time spent by a rewriter, only maintained when enabled with the `timing`
+ * option as it requires to read the clock around each callback */
+typedef struct {
+    uint64_t total_ns; /* in lol-html calls, including handlers and sink */
+    uint64_t handler_ns;
+    uint64_t sink_ns;
+} rewriter_timings_t;
+
+#define LATENCY_BUCKETS 24
+
+/* output latency, only maintained when enabled with the `latency` option. A
+ * write is considered held back until the sink is called (during that write or
+ * a later one), as lol-html doesn't tell which input produced an output. */
+typedef struct {
+    uint64_t *pending; /* start times of the writes not followed by output */
+    size_t pending_len;
+    size_t pending_cap;
+    uint64_t held_bytes;
+    uint64_t max_held_bytes;
+    uint64_t released;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    /* bucket i counts hold times in [2^i, 2^(i+1)) microseconds, the first one
+     * also gets anything under 1µs and the last one anything above */
+    uint64_t histogram[LATENCY_BUCKETS];
+} rewriter_latency_t;
+
+enum {
+    TRACE_WRITE,
+    TRACE_CLOSE,
+    TRACE_CALLBACK,
+    TRACE_SINK,
+    TRACE_ERROR,
+};
+
+/* argument of error events not raised by a handler */
+#define TRACE_IN_SINK HANDLER_TYPES_COUNT
+#define TRACE_IN_REWRITER (HANDLER_TYPES_COUNT + 1)
+
+#define TRACE_DEFAULT_EVENTS 4096
+
+/* timeline of a document, recorded when enabled with the `trace` option. The
+ * events are kept in a fixed size ring buffer: once full, the oldest events
+ * are overwritten. */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    const char *selector; /* for callbacks, anchored by the builder */
+    uint64_t arg; /* chunk length, handler type or TRACE_IN_* for errors */
+    int kind;
+} trace_event_t;
+
+typedef struct {
+    trace_event_t *events; /* NULL when tracing is disabled */
+    size_t cap;
+    size_t len; /* total number of events recorded, can be larger than cap */
+} rewriter_trace_t;
+
+/* per-state object counters, kept in a userdata stored in the registry
+ * (there is no process-wide state, see above) */
+#define METRICS_KEY (PREFIX "metrics")
+
+typedef struct {
+    /* live objects, maintained by the constructors and the __gc functions */
+    uint64_t builders;
+    uint64_t rewriters;
+    uint64_t selectors;
+    uint64_t templates;
+    uint64_t handlers;
+    /* cumulative totals since the module was loaded */
+    uint64_t builders_total;
+    uint64_t rewriters_total;
+    uint64_t selectors_total;
+    uint64_t templates_total;
+    uint64_t handlers_total;
+    uint64_t documents_total;
+#ifdef LOLHTML_ALLOC_HOOK
+    long long native_bytes; /* allocated while this state was calling lol-html */
+    long long gc_debt; /* allocations not reported to the GC yet */
+#endif
+} module_metrics_t;
+
+/* native allocations reported at once to the GC */
+#define NATIVE_GC_STEP (64 * 1024)
+
+#define CAPTURE_DEFAULT_MAX_BYTES (1024 * 1024)
+
+typedef struct {
+    size_t len;
+    uint64_t ns; /* time spent in `write` for this chunk */
+} capture_chunk_t;
 
+/* input of the current document, kept when enabled with the `capture` option
+ * to be dumped if the document turns out to be slow */
 typedef struct {
+    bool enabled;
+    bool has_hook; /* the hook is anchored in the uservalue */
+    char *dir;
+    size_t max_bytes;
+    uint64_t threshold_ns;
+    uint64_t max_callbacks;
+    /* per-document data */
+    char *data;
+    size_t len;
+    size_t cap;
+    capture_chunk_t *chunks;
+    size_t nchunks;
+    size_t chunks_cap;
+    uint64_t bytes_in;
+    uint64_t ns;
+    bool truncated;
+} rewriter_capture_t;
+
+/* Traffic recording (`record` option), replayed by tools/lolhtml-replay. The
+ * file starts with RECORD_MAGIC followed by records, each one made of a type
+ * byte, the time since the start of the document in nanoseconds (u64), the
+ * data length (u32) and the data itself. Integers are little endian. A file
+ * can hold any number of documents, but only one rewriter can record to it at
+ * a time as the records are written through a buffered stream. */
+#define RECORD_MAGIC "LOLREC01"
+
+enum {
+    RECORD_DOCUMENT = 'D',
+    RECORD_WRITE = 'W',
+    RECORD_CLOSE = 'C',
+};
+
+typedef struct lua_rewriter_s lua_rewriter_t;
+
+typedef struct handler_data_s handler_data_t;
+
+#define TEXT_NODE_DEFAULT_MAX_LENGTH (1024 * 1024)
+#define CAPTURE_DEFAULT_MAX_LENGTH (1024 * 1024)
+
+/* per-rewriter buffer of a handler, e.g. to accumulate text nodes */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    /* start offsets of the elements being captured (CAPTURE_START_PENDING
+     * until known), captures of nested elements share the buffer */
+    size_t *starts;
+    size_t depth;
+    size_t starts_cap;
+} handler_buffer_t;
+
+/* Value of an element kept between its start and end tags for the end tag
+ * handler. Integers and booleans are stored in the slot, other values are
+ * referenced in a per-rewriter table. The slots are pooled by the rewriter. */
+enum {
+    SLOT_NIL,
+    SLOT_BOOLEAN,
+    SLOT_INTEGER,
+    SLOT_REF,
+};
+
+typedef struct end_tag_slot_s end_tag_slot_t;
+struct end_tag_slot_s {
+    handler_data_t *handler;
+    int kind;
+    lua_Integer value; /* or reference */
+    bool used;
+    end_tag_slot_t *next; /* all the slots of the rewriter */
+    end_tag_slot_t *next_free;
+};
+
+/* element content capture modes */
+enum {
+    CAPTURE_NONE,
+    CAPTURE_TEXT,
+    CAPTURE_HTML,
+};
+
+/* inserted at the start of the elements captured as HTML, it marks where the
+ * capture starts in the output and is stripped by the sink. It holds a random
+ * per-rewriter nonce, so that a document can't forge it with its own comments,
+ * followed by the buffer index and the position of the element in the buffer
+ * stack: <!--lolhtml:capture:NONCE:INDEX:POS--> */
+#define CAPTURE_MARKER "<!--lolhtml:capture:"
+#define CAPTURE_MARKER_END "-->"
+#define CAPTURE_NONCE_LEN 16
+
+/* Content events queued by event handlers (registered with `true` instead of
+ * a function) for Rewriter:events. The content is only valid during the
+ * lol-html callback, so it is copied in a per-rewriter arena, cleared at each
+ * write. Offsets are used rather than pointers as the arena can move. */
+#define EVENT_NO_DATA SIZE_MAX
+
+typedef struct {
+    handler_data_t *handler;
+    int type;
+    bool last; /* last chunk of a text node */
+    size_t off; /* text, tag name or doctype name, EVENT_NO_DATA if none */
+    size_t len;
+    size_t attrs; /* index of the first attribute value */
+} event_t;
+
+typedef struct {
+    size_t off; /* EVENT_NO_DATA if the attribute is missing */
+    size_t len;
+} event_attr_t;
+
+typedef struct {
+    event_t *events;
+    size_t len;
+    size_t cap;
+    /* values of the attributes requested by the handlers, in order */
+    event_attr_t *attrs;
+    size_t attrs_len;
+    size_t attrs_cap;
+    char *data;
+    size_t data_len;
+    size_t data_cap;
+    /* iteration state */
+    size_t pos;
+    bool reuse;
+} event_buffer_t;
+
+typedef struct {
+    lol_html_selector_t *selector;
+    char source[];
+} lua_selector_t;
+
+typedef struct {
+    lol_html_rewriter_builder_t *builder;
+    /* rewriter currently feeding data to this builder's handlers (if any), it
+     * is used by the callbacks to retrieve per-document data */
+    lua_rewriter_t *active;
+    /* list of all the handlers, in registration order, for profiling */
+    handler_data_t *handlers;
+    handler_data_t *last_handler;
+    /* number of handlers needing a per-rewriter buffer */
+    int nbuffers;
+    /* number of handlers capturing HTML, checked by the sink */
+    int html_captures;
+} lua_builder_t;
+
+struct handler_data_s {
     lua_State *L;
+    lua_builder_t *builder;
     int builder_index;
     int callback_index;
-} handler_data_t;
+    int type;
+    const char *selector; /* source, NULL for document content handlers */
+    /* profiling counters, aggregated over all rewriters */
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t time_ns; /* only measured by rewriters with `timing` enabled */
+    handler_data_t *next;
+    bool event; /* queues events instead of calling a function */
+    bool batch; /* the function is called with all the events after a write */
+    bool text_node; /* text handler called once per text node */
+    int capture; /* element handler called with the element content */
+    handler_data_t *end_tag; /* end tag handler of the same element handlers */
+    end_tag_slot_t *slot; /* slot of the current element, for end tag handlers */
+    size_t max_length; /* of text nodes and captures */
+    int buffer_index; /* index of the per-rewriter buffer, -1 if none */
+    /* attributes recorded in element events, anchored by the builder */
+    size_t nattributes;
+    const char *attributes[];
+};
+
+struct lua_rewriter_s {
+    lol_html_rewriter_t *rewriter;
+    lua_builder_t *builder;
+    lua_State *L;
+    int reg_idx;
+    bool broken; /* used to signal sink errors */
+    bool busy; /* set while lol-html is processing data */
+    bool has_context;
+    /* settings kept to build the rewriter again on reset, the encoding string
+     * is anchored in the uservalue */
+    const char *encoding;
+    size_t encoding_len;
+    lol_html_memory_settings_t memory_settings;
+    bool strict;
+    rewriter_stats_t stats;
+    bool timing;
+    rewriter_timings_t timings;
+    bool track_latency;
+    rewriter_latency_t latency;
+    rewriter_trace_t trace;
+    rewriter_capture_t capture;
+    FILE *record; /* NULL when not recording */
+    uint64_t record_start;
+    event_buffer_t events;
+    handler_buffer_t *buffers; /* indexed by handler->buffer_index */
+    int nbuffers;
+    end_tag_slot_t *slots;
+    end_tag_slot_t *free_slots;
+    end_tag_slot_t *end_tag_slot; /* slot of the end tag handler being called */
+    char capture_nonce[CAPTURE_NONCE_LEN + 1]; /* empty until the first HTML capture */
+    /* without a sink, the output of each call is buffered and returned */
+    bool buffer_output;
+    char *output;
+    size_t output_len;
+    size_t output_cap;
+};
+
+/* the clock is needed for timings, tracing and capture */
+#define NEEDS_CLOCK(rewriter) \
+    ((rewriter)->timing || (rewriter)->trace.events != NULL || (rewriter)->capture.enabled)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_add(lua_rewriter_t *rewriter, int kind, uint64_t arg, const char *selector,
+                      uint64_t start, uint64_t end) {
+    rewriter_trace_t *trace = &rewriter->trace;
+    trace_event_t *ev;
+    if (trace->events == NULL) {
+        return;
+    }
+    ev = &trace->events[trace->len++ % trace->cap];
+    ev->kind = kind;
+    ev->arg = arg;
+    ev->selector = selector;
+    ev->start = start;
+    ev->end = end;
+}
 
 static void push_lol_str_maybe(lua_State *L, lol_html_str_t *s) {
     if (s == NULL) {
@@ -38,6 +516,9 @@ static void push_lol_str_maybe(lua_State *L, lol_html_str_t *s) {
     }
 }
 
+/* lol-html keeps the last error in a thread local variable: this must be
+ * called from the thread that made the failing call, before any other call to
+ * lol-html, otherwise the error could be lost or replaced. */
 static int push_last_error(lua_State *L) {
     lol_html_str_t *err = lol_html_take_last_error();
     lua_pushnil(L);
@@ -51,6 +532,48 @@ static int push_last_error(lua_State *L) {
     return 2;
 }
 
+static module_metrics_t *get_metrics(lua_State *L) {
+    module_metrics_t *metrics;
+    lua_getfield(L, LUA_REGISTRYINDEX, METRICS_KEY);
+    metrics = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return metrics;
+}
+
+/* credits the native allocations made by this thread since the last call to
+ * the state L. If `step` is set, the GC is also paced against them: native
+ * memory is then collected as soon as the Lua objects owning it are. It must
+ * not be set from finalizers. */
+static void native_sync(lua_State *L, bool step) {
+#ifdef LOLHTML_ALLOC_HOOK
+    module_metrics_t *metrics;
+    long long delta = native_bytes_delta;
+    if (delta == 0) {
+        return;
+    }
+    native_bytes_delta = 0;
+    metrics = get_metrics(L);
+    metrics->native_bytes += delta;
+    metrics->gc_debt += delta;
+    if (step && metrics->gc_debt >= NATIVE_GC_STEP) {
+        int kb = metrics->gc_debt / 1024;
+        metrics->gc_debt = 0;
+        lua_gc(L, LUA_GCSTEP, kb);
+    } else if (metrics->gc_debt < 0) {
+        metrics->gc_debt = 0;
+    }
+#else
+    (void)L;
+    (void)step;
+#endif
+}
+
+/* sets t[name] = n for the table at the top of the stack */
+static void set_counter(lua_State *L, const char *name, uint64_t n) {
+    lua_pushinteger(L, (lua_Integer)n);
+    lua_setfield(L, -2, name);
+}
+
 /* checks a function result code and prepares a method return to Lua:
  * if zero, shrink the stack to 1 (the self argument) and returns 1
  * otherwise, pushes nil and the error message and returns 2
@@ -80,11 +603,335 @@ static void* check_valid_udata(lua_State *L, int arg, const char *tname) {
     return ptr;
 }
 
-/* document content handlers callbacks */
+/* removes all the entries of the table at `idx`, to reuse it */
+static void clear_table(lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, idx);
+    }
+}
+
+#if LUA_VERSION_NUM >= 504
+static lua_rewriter_t *new_rewriter_userdata(lua_State *L) {
+    return lua_newuserdatauv(L, sizeof(lua_rewriter_t), REWRITER_USER_VALUES);
+}
+
+/* pushes the user value `n` of the rewriter at `idx` */
+static void get_rewriter_value(lua_State *L, int idx, int n) {
+    lua_getiuservalue(L, idx, n);
+}
+
+/* pops a value and sets it as the user value `n` of the rewriter at `idx` */
+static void set_rewriter_value(lua_State *L, int idx, int n) {
+    lua_setiuservalue(L, idx, n);
+}
+#else
+static lua_rewriter_t *new_rewriter_userdata(lua_State *L) {
+    lua_rewriter_t *rewriter = lua_newuserdata(L, sizeof(lua_rewriter_t));
+    lua_createtable(L, REWRITER_USER_VALUES, 0);
+    lua_setuservalue(L, -2);
+    return rewriter;
+}
+
+static void get_rewriter_value(lua_State *L, int idx, int n) {
+    lua_getuservalue(L, idx);
+    lua_rawgeti(L, -1, n);
+    lua_remove(L, -2);
+}
+
+static void set_rewriter_value(lua_State *L, int idx, int n) {
+    idx = lua_absindex(L, idx);
+    lua_getuservalue(L, idx);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, n);
+    lua_pop(L, 1);
+}
+#endif
+
+/* pushes the user value `n` of a rewriter from a callback */
+static void push_rewriter_field(lua_State *L, lua_rewriter_t *rewriter, int n) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LOL_REGISTRY); /* reg */
+    lua_rawgeti(L, -1, rewriter->reg_idx);            /* reg, rewriter */
+    get_rewriter_value(L, -1, n);                     /* reg, rewriter, val */
+    lua_replace(L, -3);                               /* val, rewriter */
+    lua_pop(L, 1);                                    /* val */
+}
+
+/* grows the array at `*ptr` to hold at least `need` elements */
+static bool grow_array(void **ptr, size_t *cap, size_t need, size_t size) {
+    size_t n;
+    void *p;
+    if (need <= *cap) {
+        return true;
+    }
+    for (n = *cap ? *cap : 64; n < need; n *= 2) {}
+    if ((p = realloc(*ptr, n * size)) == NULL) {
+        return false;
+    }
+    *ptr = p;
+    *cap = n;
+    return true;
+}
+
+/* copies data in the event arena, sets `*off` to its offset */
+static bool event_data(event_buffer_t *buf, const char *data, size_t len, size_t *off) {
+    if (!grow_array((void **)&buf->data, &buf->data_cap, buf->data_len + len, 1)) {
+        return false;
+    }
+    if (len > 0) {
+        memcpy(buf->data + buf->data_len, data, len);
+    }
+    *off = buf->data_len;
+    buf->data_len += len;
+    return true;
+}
+
+/* same as above, also frees the lol-html string */
+static bool event_str(event_buffer_t *buf, lol_html_str_t s, size_t *off, size_t *len) {
+    bool ok = event_data(buf, s.data, s.len, off);
+    *len = s.len;
+    lol_html_str_free(s);
+    return ok;
+}
+
+static void events_clear(event_buffer_t *buf) {
+    buf->len = buf->attrs_len = buf->data_len = buf->pos = 0;
+}
+
+/* returns the buffer of the handler for this rewriter, the buffers are
+ * allocated lazily as the builder can get new handlers after the rewriter was
+ * created */
+static handler_buffer_t *get_handler_buffer(lua_rewriter_t *rewriter, handler_data_t *handler) {
+    if (handler->buffer_index >= rewriter->nbuffers) {
+        int n = handler->builder->nbuffers;
+        handler_buffer_t *buffers = realloc(rewriter->buffers, n * sizeof(handler_buffer_t));
+        if (buffers == NULL) {
+            return NULL;
+        }
+        memset(buffers + rewriter->nbuffers, 0, (n - rewriter->nbuffers) * sizeof(handler_buffer_t));
+        rewriter->buffers = buffers;
+        rewriter->nbuffers = n;
+    }
+    return &rewriter->buffers[handler->buffer_index];
+}
+
+/* appends data to a handler buffer, up to `max` bytes */
+static bool buffer_append(handler_buffer_t *buf, const char *data, size_t len, size_t max) {
+    if (buf->len >= max) {
+        return true;
+    }
+    if (len > max - buf->len) {
+        len = max - buf->len;
+    }
+    if (!grow_array((void **)&buf->data, &buf->cap, buf->len + len, 1)) {
+        return false;
+    }
+    if (len > 0) {
+        memcpy(buf->data + buf->len, data, len);
+    }
+    buf->len += len;
+    return true;
+}
+
+/* pushes the table referencing the slot values of a rewriter, it is created
+ * on first use */
+static void push_slot_values(lua_State *L, lua_rewriter_t *rewriter) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LOL_REGISTRY);     /* reg */
+    lua_rawgeti(L, -1, rewriter->reg_idx);                /* reg, rewriter */
+    get_rewriter_value(L, -1, REWRITER_VALUES_INDEX);     /* reg, rewriter, values */
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);                                    /* reg, rewriter */
+        lua_newtable(L);                                  /* reg, rewriter, values */
+        lua_pushvalue(L, -1);                             /* reg, rewriter, values, values */
+        set_rewriter_value(L, -3, REWRITER_VALUES_INDEX); /* reg, rewriter, values */
+    }
+    lua_replace(L, -3);                                   /* values, rewriter */
+    lua_pop(L, 1);                                        /* values */
+}
+
+/* returns a free slot for an element matched by `handler`, NULL if out of
+ * memory */
+static end_tag_slot_t *slot_acquire(lua_rewriter_t *rewriter, handler_data_t *handler) {
+    end_tag_slot_t *slot = rewriter->free_slots;
+    if (slot != NULL) {
+        rewriter->free_slots = slot->next_free;
+    } else {
+        if ((slot = malloc(sizeof(end_tag_slot_t))) == NULL) {
+            return NULL;
+        }
+        slot->next = rewriter->slots;
+        rewriter->slots = slot;
+    }
+    slot->handler = handler;
+    slot->kind = SLOT_NIL;
+    slot->used = 1;
+    return slot;
+}
+
+static void slot_clear(lua_State *L, lua_rewriter_t *rewriter, end_tag_slot_t *slot) {
+    if (slot->kind == SLOT_REF) {
+        push_slot_values(L, rewriter);
+        luaL_unref(L, -1, (int)slot->value);
+        lua_pop(L, 1);
+    }
+    slot->kind = SLOT_NIL;
+}
+
+static void slot_release(lua_State *L, lua_rewriter_t *rewriter, end_tag_slot_t *slot) {
+    slot_clear(L, rewriter, slot);
+    slot->used = 0;
+    slot->next_free = rewriter->free_slots;
+    rewriter->free_slots = slot;
+}
+
+/* stores the value at `idx` in the slot */
+static void slot_set(lua_State *L, lua_rewriter_t *rewriter, end_tag_slot_t *slot, int idx) {
+    idx = lua_absindex(L, idx);
+    slot_clear(L, rewriter, slot);
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        break;
+    case LUA_TBOOLEAN:
+        slot->kind = SLOT_BOOLEAN;
+        slot->value = lua_toboolean(L, idx);
+        break;
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+            slot->kind = SLOT_INTEGER;
+            slot->value = lua_tointeger(L, idx);
+            break;
+        }
+        /* fall through */
+    default:
+        push_slot_values(L, rewriter);
+        lua_pushvalue(L, idx);
+        slot->value = luaL_ref(L, -2);
+        slot->kind = SLOT_REF;
+        lua_pop(L, 1);
+    }
+}
+
+static void slot_push(lua_State *L, lua_rewriter_t *rewriter, const end_tag_slot_t *slot) {
+    switch (slot->kind) {
+    case SLOT_BOOLEAN:
+        lua_pushboolean(L, (int)slot->value);
+        break;
+    case SLOT_INTEGER:
+        lua_pushinteger(L, slot->value);
+        break;
+    case SLOT_REF:
+        push_slot_values(L, rewriter);
+        lua_rawgeti(L, -1, slot->value);
+        lua_remove(L, -2);
+        break;
+    default:
+        lua_pushnil(L);
+    }
+}
+
+/* snapshots a content handler parameter as an event, returns false if out of
+ * memory */
+static bool queue_event(lua_rewriter_t *rewriter, int type, void *param, handler_data_t *handler) {
+    event_buffer_t *buf = &rewriter->events;
+    lol_html_str_t *s;
+    event_t *ev;
+    bool ok = true;
+    size_t i;
+
+    if (!grow_array((void **)&buf->events, &buf->cap, buf->len + 1, sizeof(event_t))) {
+        return false;
+    }
+    ev = &buf->events[buf->len];
+    ev->handler = handler;
+    ev->type = type;
+    ev->last = 0;
+    ev->off = EVENT_NO_DATA;
+    ev->len = 0;
+    ev->attrs = buf->attrs_len;
+
+    switch (type) {
+    case HANDLER_DOCTYPE:
+        if ((s = lol_html_doctype_name_get(param)) != NULL) {
+            ok = event_str(buf, *s, &ev->off, &ev->len);
+            free(s);
+        }
+        break;
+    case HANDLER_COMMENT:
+        ok = event_str(buf, lol_html_comment_text_get(param), &ev->off, &ev->len);
+        break;
+    case HANDLER_TEXT: {
+        lol_html_text_chunk_content_t content = lol_html_text_chunk_content_get(param);
+        ok = event_data(buf, content.data, content.len, &ev->off);
+        ev->len = content.len;
+        ev->last = lol_html_text_chunk_is_last_in_text_node(param);
+        break;
+    }
+    case HANDLER_ELEMENT:
+        ok = event_str(buf, lol_html_element_tag_name_get(param), &ev->off, &ev->len)
+            && grow_array((void **)&buf->attrs, &buf->attrs_cap,
+                          buf->attrs_len + handler->nattributes, sizeof(event_attr_t));
+        for (i = 0; ok && i < handler->nattributes; i++) {
+            const char *name = handler->attributes[i];
+            event_attr_t *attr = &buf->attrs[buf->attrs_len++];
+            attr->off = EVENT_NO_DATA;
+            attr->len = 0;
+            if ((s = lol_html_element_get_attribute(param, name, strlen(name))) != NULL) {
+                ok = event_str(buf, *s, &attr->off, &attr->len);
+                free(s);
+            }
+        }
+        break;
+    }
+    if (ok) {
+        buf->len++;
+    }
+    return ok;
+}
+
+/* fills the table at the top of the stack with the fields of an event */
+static void push_event_fields(lua_State *L, event_buffer_t *buf, const event_t *ev) {
+    const handler_data_t *handler = ev->handler;
+    size_t i;
+
+    lua_pushstring(L, handler_type_names[ev->type]);
+    lua_setfield(L, -2, "type");
+    if (handler->selector != NULL) {
+        lua_pushstring(L, handler->selector);
+        lua_setfield(L, -2, "selector");
+    }
+    if (ev->off != EVENT_NO_DATA) {
+        lua_pushlstring(L, buf->data + ev->off, ev->len);
+        lua_setfield(L, -2, ev->type == HANDLER_ELEMENT ? "tag"
+                            : ev->type == HANDLER_DOCTYPE ? "name" : "text");
+    }
+    if (ev->type == HANDLER_TEXT) {
+        lua_pushboolean(L, ev->last);
+        lua_setfield(L, -2, "last");
+    } else if (ev->type == HANDLER_ELEMENT && handler->nattributes > 0) {
+        lua_createtable(L, 0, handler->nattributes);
+        for (i = 0; i < handler->nattributes; i++) {
+            const event_attr_t *attr = &buf->attrs[ev->attrs + i];
+            if (attr->off != EVENT_NO_DATA) {
+                lua_pushlstring(L, buf->data + attr->off, attr->len);
+                lua_setfield(L, -2, handler->attributes[i]);
+            }
+        }
+        lua_setfield(L, -2, "attributes");
+    }
+}
+
+/* calls the Lua function of a handler with `param` wrapped in a userdata, or
+ * with the string `str` if it is not NULL */
 static lol_html_rewriter_directive_t
-do_document_content_callback(const char *param_type, void *param, handler_data_t *handler) {
+call_lua_handler(int type, void *param, const char *str, size_t str_len, handler_data_t *handler) {
     lol_html_rewriter_directive_t directive;
     lua_State *L = handler->L;
+    lua_rewriter_t *rewriter = handler->builder->active;
+    int nargs = 1;
 
     /* locate the handler to call */
     lua_getfield(L, LUA_REGISTRYINDEX, LOL_REGISTRY); /* reg */
@@ -95,17 +942,56 @@ do_document_content_callback(const char *param_type, void *param, handler_data_t
     lua_pop(L, 2);                                    /* cb */
 
     /* allocate the parameter object */
-    void **lua_param = lua_newuserdata(handler->L, sizeof(void *));
-    luaL_getmetatable(L, param_type);
-    lua_setmetatable(L, -2);
-    *lua_param = param;
+    void **lua_param = NULL;
+    if (str != NULL) {
+        lua_pushlstring(L, str, str_len);
+    } else {
+        /* elements also keep the slot of their end tag handler (if any) */
+        lua_param = lua_newuserdata(handler->L, 2 * sizeof(void *));
+        luaL_getmetatable(L, handler_param_types[type]);
+        lua_setmetatable(L, -2);
+        lua_param[0] = param;
+        lua_param[1] = handler->end_tag != NULL ? handler->end_tag->slot : NULL;
+    }
+
+    handler->calls++;
+    if (rewriter != NULL) {
+        STAT_ADD(rewriter, callbacks[type], 1);
+        /* end tag handlers get the value of the element */
+        if (type == HANDLER_END_TAG) {
+            slot_push(L, rewriter, rewriter->end_tag_slot);
+            nargs++;
+        }
+        /* pass the per-document context as last argument */
+        if (rewriter->has_context) {
+            push_rewriter_field(L, rewriter, REWRITER_CONTEXT_INDEX);
+            nargs++;
+        }
+    }
 
-    int rc = lua_pcall(L, 1, 1, 0);
-    *lua_param = NULL; /* signals that this value cannot be used anymore */
+    PROBE2(callback_start, rewriter, type);
+    uint64_t end = 0, start = (rewriter != NULL && NEEDS_CLOCK(rewriter)) ? now_ns() : 0;
+    int rc = lua_pcall(L, nargs, 1, 0);
+    if (start != 0) {
+        end = now_ns();
+        if (rewriter->timing) {
+            rewriter->timings.handler_ns += end - start;
+            handler->time_ns += end - start;
+        }
+        trace_add(rewriter, TRACE_CALLBACK, type, handler->selector, start, end);
+    }
+    PROBE3(callback_done, rewriter, type, rc);
+    if (lua_param != NULL) {
+        *lua_param = NULL; /* signals that this value cannot be used anymore */
+    }
     if (rc != LUA_OK) {
         /* in case of error, just leave the error on the stack, the calling
          * site will check if the stack level changed and assume an error
          * happened if it did */
+        handler->errors++;
+        if (start != 0) {
+            trace_add(rewriter, TRACE_ERROR, type, handler->selector, end, end);
+        }
         return LOL_HTML_STOP;
     }
 
@@ -129,39 +1015,311 @@ do_document_content_callback(const char *param_type, void *param, handler_data_t
     return directive;
 
 type_error:
+    handler->errors++;
+    if (start != 0) {
+        trace_add(rewriter, TRACE_ERROR, type, handler->selector, end, end);
+    }
     lua_pop(L, 1); /* pop the function result */
     lua_pushliteral(L, "invalid content handler return");
     return LOL_HTML_STOP;
 }
 
+/* document content handlers callbacks */
+static lol_html_rewriter_directive_t
+do_document_content_callback(int type, void *param, handler_data_t *handler) {
+    lol_html_rewriter_directive_t directive;
+    lua_State *L = handler->L;
+    lua_rewriter_t *rewriter = handler->builder->active;
+
+    if (handler->event) {
+        handler->calls++;
+        if (rewriter == NULL) {
+            return LOL_HTML_CONTINUE;
+        }
+        STAT_ADD(rewriter, callbacks[type], 1);
+        if (!queue_event(rewriter, type, param, handler)) {
+            /* reported as a Lua error, like in call_lua_handler */
+            handler->errors++;
+            lua_pushliteral(L, "not enough memory");
+            return LOL_HTML_STOP;
+        }
+        return LOL_HTML_CONTINUE;
+    }
+
+    /* text nodes are accumulated, the handler is called with the whole text
+     * at the last chunk */
+    if (handler->text_node && rewriter != NULL) {
+        handler_buffer_t *text;
+        lol_html_text_chunk_content_t content = lol_html_text_chunk_content_get(param);
+        if ((text = get_handler_buffer(rewriter, handler)) == NULL
+                || !buffer_append(text, content.data, content.len, handler->max_length)) {
+            handler->errors++;
+            lua_pushliteral(L, "not enough memory");
+            return LOL_HTML_STOP;
+        }
+        if (!lol_html_text_chunk_is_last_in_text_node(param)) {
+            return LOL_HTML_CONTINUE;
+        }
+        directive = call_lua_handler(type, NULL, text->data ? text->data : "", text->len, handler);
+        text->len = 0;
+        return directive;
+    }
+
+    return call_lua_handler(type, param, NULL, 0, handler);
+}
+
 static lol_html_rewriter_directive_t
 doctype_handler(lol_html_doctype_t *doctype, void *user_data)
 {
-    return do_document_content_callback(PREFIX "doctype", doctype, user_data);
+    return do_document_content_callback(HANDLER_DOCTYPE, doctype, user_data);
 }
 
 static lol_html_rewriter_directive_t
 comment_handler(lol_html_comment_t *comment, void *user_data)
 {
-    return do_document_content_callback(PREFIX "comment", comment, user_data);
+    return do_document_content_callback(HANDLER_COMMENT, comment, user_data);
 }
 
 static lol_html_rewriter_directive_t
 text_chunk_handler(lol_html_text_chunk_t *chunk, void *user_data)
 {
-    return do_document_content_callback(PREFIX "text_chunk", chunk, user_data);
+    return do_document_content_callback(HANDLER_TEXT, chunk, user_data);
 }
 
 static lol_html_rewriter_directive_t
 doc_end_handler(lol_html_doc_end_t *doc_end, void *user_data)
 {
-    return do_document_content_callback(PREFIX "doc_end", doc_end, user_data);
+    return do_document_content_callback(HANDLER_DOC_END, doc_end, user_data);
 }
 
 static lol_html_rewriter_directive_t
 element_handler(lol_html_element_t *element, void *user_data)
 {
-    return do_document_content_callback(PREFIX "element", element, user_data);
+    return do_document_content_callback(HANDLER_ELEMENT, element, user_data);
+}
+
+/* end tag handlers: a slot is acquired for each matched element, before the
+ * element handlers, and released after the end tag handler */
+static lol_html_rewriter_directive_t
+end_tag_handler(lol_html_end_tag_t *end_tag, void *user_data)
+{
+    lol_html_rewriter_directive_t directive;
+    end_tag_slot_t *slot = user_data;
+    handler_data_t *handler = slot->handler;
+    lua_rewriter_t *rewriter = handler->builder->active;
+
+    if (rewriter == NULL) {
+        return LOL_HTML_CONTINUE;
+    }
+    rewriter->end_tag_slot = slot;
+    directive = call_lua_handler(HANDLER_END_TAG, end_tag, NULL, 0, handler);
+    rewriter->end_tag_slot = NULL;
+    slot_release(handler->L, rewriter, slot);
+    return directive;
+}
+
+static lol_html_rewriter_directive_t
+end_tag_start_handler(lol_html_element_t *element, void *user_data)
+{
+    handler_data_t *handler = user_data;
+    lua_rewriter_t *rewriter = handler->builder->active;
+    end_tag_slot_t *slot;
+
+    handler->slot = NULL;
+    if (rewriter == NULL) {
+        return LOL_HTML_CONTINUE;
+    }
+    if ((slot = slot_acquire(rewriter, handler)) == NULL) {
+        handler->errors++;
+        lua_pushliteral(handler->L, "not enough memory");
+        return LOL_HTML_STOP;
+    }
+    if (lol_html_element_add_end_tag_handler(element, end_tag_handler, slot) != 0) {
+        /* no end tag (void or self-closing element) */
+        lua_pop(handler->L, push_last_error(handler->L));
+        slot_release(handler->L, rewriter, slot);
+        return LOL_HTML_CONTINUE;
+    }
+    handler->slot = slot;
+    return LOL_HTML_CONTINUE;
+}
+
+/* element content capture: an entry is pushed on the buffer stack for each
+ * captured element, with the offset of its content in the buffer. Text is
+ * appended by capture_text_handler (or the sink for HTML) and the handler is
+ * called at the end tag. For HTML, the offset is only known when the sink
+ * sees the marker of the element, the entry stays pending until then (or for
+ * good if another handler dropped the marker). */
+#define CAPTURE_START_PENDING SIZE_MAX
+
+static bool capture_push(handler_buffer_t *buf, size_t start) {
+    if (!grow_array((void **)&buf->starts, &buf->starts_cap, buf->depth + 1, sizeof(size_t))) {
+        return false;
+    }
+    buf->starts[buf->depth++] = start;
+    return true;
+}
+
+/* returns the offset of the innermost element with a known start, or
+ * CAPTURE_START_PENDING if there is none */
+static size_t capture_innermost_start(const handler_buffer_t *buf) {
+    size_t i;
+    for (i = buf->depth; i > 0; i--) {
+        if (buf->starts[i - 1] != CAPTURE_START_PENDING) {
+            return buf->starts[i - 1];
+        }
+    }
+    return CAPTURE_START_PENDING;
+}
+
+/* each element keeps up to `max` bytes of its content: outer elements start
+ * earlier, so only the limit of the innermost one matters */
+static bool capture_append(handler_buffer_t *buf, const char *data, size_t len, size_t max) {
+    size_t start = capture_innermost_start(buf);
+    if (start == CAPTURE_START_PENDING) {
+        return true;
+    }
+    return buffer_append(buf, data, len, max > SIZE_MAX - start ? SIZE_MAX : start + max);
+}
+
+/* pops the innermost element and calls the handler with its content */
+static lol_html_rewriter_directive_t capture_pop(handler_data_t *handler, handler_buffer_t *buf) {
+    lol_html_rewriter_directive_t directive;
+    size_t start = buf->starts[--buf->depth], len = 0;
+
+    if (start != CAPTURE_START_PENDING && start < buf->len) {
+        len = buf->len - start;
+        if (len > handler->max_length) {
+            len = handler->max_length;
+        }
+    }
+    directive = call_lua_handler(HANDLER_ELEMENT, NULL, len > 0 ? buf->data + start : "", len, handler);
+    /* drop what the outer elements don't keep */
+    start = capture_innermost_start(buf);
+    if (start == CAPTURE_START_PENDING) {
+        buf->len = 0;
+    } else if (buf->len - start > handler->max_length) {
+        buf->len = start + handler->max_length;
+    }
+    return directive;
+}
+
+/* the nonce is only needed by rewriters capturing HTML, so it is generated
+ * lazily, from the clock if /dev/urandom is not available */
+static void capture_nonce_init(lua_rewriter_t *rewriter) {
+    uint64_t nonce;
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (f == NULL || fread(&nonce, sizeof(nonce), 1, f) != 1) {
+        nonce = now_ns() ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)rewriter;
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    snprintf(rewriter->capture_nonce, sizeof(rewriter->capture_nonce), "%016llx",
+             (unsigned long long)nonce);
+}
+
+static lol_html_rewriter_directive_t
+capture_end_handler(lol_html_end_tag_t *end_tag, void *user_data)
+{
+    handler_data_t *handler = user_data;
+    lua_rewriter_t *rewriter = handler->builder->active;
+    handler_buffer_t *buf;
+
+    (void)end_tag;
+    if (rewriter == NULL || (buf = get_handler_buffer(rewriter, handler)) == NULL || buf->depth == 0) {
+        return LOL_HTML_CONTINUE;
+    }
+    /* elements of a handler are nested, so the innermost entry is this one */
+    return capture_pop(handler, buf);
+}
+
+static lol_html_rewriter_directive_t
+capture_element_handler(lol_html_element_t *element, void *user_data)
+{
+    handler_data_t *handler = user_data;
+    lua_rewriter_t *rewriter = handler->builder->active;
+    handler_buffer_t *buf;
+
+    if (rewriter == NULL) {
+        return LOL_HTML_CONTINUE;
+    }
+    if ((buf = get_handler_buffer(rewriter, handler)) == NULL) {
+        handler->errors++;
+        lua_pushliteral(handler->L, "not enough memory");
+        return LOL_HTML_STOP;
+    }
+    if (lol_html_element_add_end_tag_handler(element, capture_end_handler, handler) != 0) {
+        /* no end tag (void or self-closing element): nothing to capture */
+        lua_pop(handler->L, push_last_error(handler->L));
+        return call_lua_handler(HANDLER_ELEMENT, NULL, "", 0, handler);
+    }
+    if (handler->capture == CAPTURE_HTML) {
+        char marker[80];
+        int len;
+        if (rewriter->capture_nonce[0] == '\0') {
+            capture_nonce_init(rewriter);
+        }
+        len = snprintf(marker, sizeof(marker), CAPTURE_MARKER "%s:%d:%zu" CAPTURE_MARKER_END,
+                       rewriter->capture_nonce, handler->buffer_index, buf->depth);
+        if (lol_html_element_prepend(element, marker, len, true) != 0) {
+            handler->errors++;
+            push_last_error(handler->L);
+            lua_remove(handler->L, -2);
+            return LOL_HTML_STOP;
+        }
+    }
+    if (!capture_push(buf, handler->capture == CAPTURE_HTML ? CAPTURE_START_PENDING : buf->len)) {
+        handler->errors++;
+        lua_pushliteral(handler->L, "not enough memory");
+        return LOL_HTML_STOP;
+    }
+    return LOL_HTML_CONTINUE;
+}
+
+/* lol-html doesn't call the end tag handlers of the elements still open at
+ * the end of the document, their handlers are called by close with the
+ * content captured so far, innermost first. Returns false if a handler raised
+ * an error, left on the stack. */
+static bool capture_close_pending(lua_rewriter_t *rewriter) {
+    handler_data_t *handler;
+    handler_buffer_t *buf;
+    int top;
+
+    for (handler = rewriter->builder->handlers; handler != NULL; handler = handler->next) {
+        if (handler->capture == CAPTURE_NONE || handler->buffer_index >= rewriter->nbuffers) {
+            continue;
+        }
+        buf = &rewriter->buffers[handler->buffer_index];
+        top = lua_gettop(handler->L);
+        while (buf->depth > 0) {
+            capture_pop(handler, buf);
+            if (lua_gettop(handler->L) != top) {
+                buf->depth = buf->len = 0;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static lol_html_rewriter_directive_t
+capture_text_handler(lol_html_text_chunk_t *chunk, void *user_data)
+{
+    handler_data_t *handler = user_data;
+    lua_rewriter_t *rewriter = handler->builder->active;
+    handler_buffer_t *buf;
+    lol_html_text_chunk_content_t content = lol_html_text_chunk_content_get(chunk);
+
+    if (rewriter == NULL || (buf = get_handler_buffer(rewriter, handler)) == NULL || buf->depth == 0) {
+        return LOL_HTML_CONTINUE;
+    }
+    if (!capture_append(buf, content.data, content.len, handler->max_length)) {
+        handler->errors++;
+        lua_pushliteral(handler->L, "not enough memory");
+        return LOL_HTML_STOP;
+    }
+    return LOL_HTML_CONTINUE;
 }
 
 /* doctype */
@@ -183,7 +1341,7 @@ static int doctype_get_system_id(lua_State *L) {
     return 1;
 }
 
-static luaL_Reg doctype_methods[] = {
+static const luaL_Reg doctype_methods[] = {
     { "get_name", doctype_get_name },
     { "get_id", doctype_get_id },
     { "get_system_id", doctype_get_system_id },
@@ -242,7 +1400,7 @@ static int comment_is_removed(lua_State *L) {
     return 1;
 }
 
-static luaL_Reg comment_methods[] = {
+static const luaL_Reg comment_methods[] = {
     { "get_text", comment_get_text },
     { "set_text", comment_set_text },
     { "before", comment_before },
@@ -304,8 +1462,134 @@ static int text_chunk_is_removed(lua_State *L) {
     return 1;
 }
 
-static luaL_Reg text_chunk_methods[] = {
+/* Text views give access to the content of a text chunk without copying it in
+ * a Lua string. They hold the text chunk userdata in their uservalue, to
+ * check that the chunk is still valid before each access. */
+typedef struct {
+    void **chunk; /* the text chunk userdata, NULL'd after the callback */
+    const char *data;
+    size_t len;
+} text_view_t;
+
+static int text_chunk_view(lua_State *L) {
+    const lol_html_text_chunk_t **chunk = check_valid_udata(L, 1, PREFIX "text_chunk");
+    lol_html_text_chunk_content_t content = lol_html_text_chunk_content_get(*chunk);
+    text_view_t *view = lua_newuserdata(L, sizeof(text_view_t));
+    view->chunk = (void **)chunk;
+    view->data = content.data;
+    view->len = content.len;
+    luaL_getmetatable(L, PREFIX "text_view");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+static text_view_t *check_text_view(lua_State *L, int arg) {
+    text_view_t *view = luaL_checkudata(L, arg, PREFIX "text_view");
+    if (*view->chunk == NULL) {
+        luaL_argerror(L, arg, "attempt to use a value past its lifetime");
+    }
+    return view;
+}
+
+/* converts a string.sub-like position to an offset in [0, len] */
+static size_t view_offset(lua_Integer pos, size_t len) {
+    if (pos > 0) {
+        return (size_t)pos > len ? len : (size_t)pos - 1;
+    } else if (pos == 0 || (size_t)-pos > len) {
+        return 0;
+    }
+    return len + pos;
+}
+
+static int text_view_len(lua_State *L) {
+    lua_pushinteger(L, check_text_view(L, 1)->len);
+    return 1;
+}
+
+static int text_view_byte(lua_State *L) {
+    text_view_t *view = check_text_view(L, 1);
+    lua_Integer i = luaL_optinteger(L, 2, 1);
+    if (i < 0) {
+        i += view->len + 1;
+    }
+    if (i < 1 || (size_t)i > view->len) {
+        return 0;
+    }
+    lua_pushinteger(L, (unsigned char)view->data[i - 1]);
+    return 1;
+}
+
+static int text_view_sub(lua_State *L) {
+    text_view_t *view = check_text_view(L, 1);
+    size_t start = view_offset(luaL_checkinteger(L, 2), view->len);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+    /* end is inclusive */
+    size_t end = j < 0 ? view_offset(j, view->len) + ((size_t)-j <= view->len)
+                       : ((size_t)j > view->len ? view->len : (size_t)j);
+    lua_pushlstring(L, view->data + start, end > start ? end - start : 0);
+    return 1;
+}
+
+/* plain search, returns the start and end positions like string.find */
+static int text_view_find(lua_State *L) {
+    size_t needle_len;
+    text_view_t *view = check_text_view(L, 1);
+    const char *needle = luaL_checklstring(L, 2, &needle_len);
+    size_t init = view_offset(luaL_optinteger(L, 3, 1), view->len);
+    const char *found;
+
+    if (needle_len == 0) {
+        found = view->data + init;
+    } else {
+        /* glibc's memmem uses a vectorized two-way search */
+        found = memmem(view->data + init, view->len - init, needle, needle_len);
+    }
+    if (found == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushinteger(L, found - view->data + 1);
+    lua_pushinteger(L, found - view->data + needle_len);
+    return 2;
+}
+
+static int text_view_startswith(lua_State *L) {
+    size_t prefix_len;
+    text_view_t *view = check_text_view(L, 1);
+    const char *prefix = luaL_checklstring(L, 2, &prefix_len);
+    lua_pushboolean(L, prefix_len <= view->len && memcmp(view->data, prefix, prefix_len) == 0);
+    return 1;
+}
+
+static int text_view_equals(lua_State *L) {
+    size_t other_len;
+    text_view_t *view = check_text_view(L, 1);
+    const char *other = luaL_checklstring(L, 2, &other_len);
+    lua_pushboolean(L, other_len == view->len && memcmp(view->data, other, other_len) == 0);
+    return 1;
+}
+
+static int text_view_tostring(lua_State *L) {
+    text_view_t *view = check_text_view(L, 1);
+    lua_pushlstring(L, view->data, view->len);
+    return 1;
+}
+
+static const luaL_Reg text_view_methods[] = {
+    { "len", text_view_len },
+    { "byte", text_view_byte },
+    { "sub", text_view_sub },
+    { "find", text_view_find },
+    { "startswith", text_view_startswith },
+    { "equals", text_view_equals },
+    { NULL, NULL }
+};
+
+static const luaL_Reg text_chunk_methods[] = {
     { "get_text", text_chunk_get_text },
+    { "view", text_chunk_view },
     { "is_last_in_text_node", text_chunk_is_last_in_text_node },
     { "before", text_chunk_before },
     { "after", text_chunk_after },
@@ -325,7 +1609,7 @@ static int doc_end_append(lua_State *L) {
     return return_self_or_err(L, lol_html_doc_end_append(*doc_end, content, content_len, is_html));
 }
 
-static luaL_Reg doc_end_methods[] = {
+static const luaL_Reg doc_end_methods[] = {
     { "append", doc_end_append },
     { NULL, NULL }
 };
@@ -431,6 +1715,80 @@ static int element_attributes(lua_State *L) {
     return 3;
 }
 
+/* fills a table (the optional argument or a new one) with the tag name,
+ * namespace and attributes of the element */
+static int element_snapshot(lua_State *L) {
+    lol_html_str_t s;
+    const lol_html_attribute_t *attr;
+    lol_html_attributes_iterator_t *it;
+    lol_html_element_t **el = check_valid_udata(L, 1, PREFIX "element");
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        lua_createtable(L, 0, 3);
+    } else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_settop(L, 2);
+    }
+
+    s = lol_html_element_tag_name_get(*el);
+    lua_pushlstring(L, s.data, s.len);
+    lol_html_str_free(s);
+    lua_setfield(L, 2, "tag");
+    lua_pushstring(L, lol_html_element_namespace_uri_get(*el));
+    lua_setfield(L, 2, "namespace");
+
+    /* reuse the attributes table of the previous snapshot */
+    if (lua_getfield(L, 2, "attributes") == LUA_TTABLE) {
+        clear_table(L, 3);
+    } else {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, 2, "attributes");
+    }
+    it = lol_html_attributes_iterator_get(*el);
+    while ((attr = lol_html_attributes_iterator_next(it)) != NULL) {
+        s = lol_html_attribute_name_get(attr);
+        lua_pushlstring(L, s.data, s.len);
+        lol_html_str_free(s);
+        s = lol_html_attribute_value_get(attr);
+        lua_pushlstring(L, s.data, s.len);
+        lol_html_str_free(s);
+        lua_rawset(L, 3);
+    }
+    lol_html_attributes_iterator_free(it);
+
+    lua_settop(L, 2);
+    return 1;
+}
+
+/* sets the value of each attribute of the `names` array in a table (the
+ * optional argument or a new one), nil for the missing ones */
+static int element_get_attributes(lua_State *L) {
+    size_t i, n, len;
+    const char *name;
+    lol_html_element_t **el = check_valid_udata(L, 1, PREFIX "element");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_rawlen(L, 2);
+    if (lua_isnoneornil(L, 3)) {
+        lua_settop(L, 2);
+        lua_createtable(L, 0, (int)n);
+    } else {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_settop(L, 3);
+    }
+
+    for (i = 1; i <= n; i++) {
+        if (lua_rawgeti(L, 2, i) != LUA_TSTRING) {
+            return luaL_error(L, "attribute names must be strings");
+        }
+        name = lua_tolstring(L, -1, &len);
+        push_lol_str_maybe(L, lol_html_element_get_attribute(*el, name, len));
+        lua_rawset(L, 3);
+    }
+    return 1;
+}
+
 static int element_before(lua_State *L) {
     size_t len;
     lol_html_element_t **el = check_valid_udata(L, 1, PREFIX "element");
@@ -497,7 +1855,30 @@ static int element_remove_and_keep_content(lua_State *L) {
     return return_self_or_err(L, 0); /* cannot fail */
 }
 
-static luaL_Reg element_methods[] = {
+/* returns the slot of the element, kept until its end tag handler returns */
+static end_tag_slot_t *check_element_slot(lua_State *L) {
+    void **el = check_valid_udata(L, 1, PREFIX "element");
+    if (el[1] == NULL) {
+        luaL_error(L, "no end tag handler for this element");
+    }
+    return el[1];
+}
+
+static int element_set_user_value(lua_State *L) {
+    end_tag_slot_t *slot = check_element_slot(L);
+    luaL_checkany(L, 2);
+    slot_set(L, slot->handler->builder->active, slot, 2);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int element_get_user_value(lua_State *L) {
+    end_tag_slot_t *slot = check_element_slot(L);
+    slot_push(L, slot->handler->builder->active, slot);
+    return 1;
+}
+
+static const luaL_Reg element_methods[] = {
     { "get_tag_name", element_get_tag_name },
     { "get_namespace_uri", element_get_namespace_uri },
     { "get_attribute", element_get_attribute },
@@ -505,6 +1886,8 @@ static luaL_Reg element_methods[] = {
     { "set_attribute", element_set_attribute },
     { "remove_attribute", element_remove_attribute },
     { "attributes", element_attributes },
+    { "snapshot", element_snapshot },
+    { "get_attributes", element_get_attributes },
     { "before", element_before },
     { "after", element_after },
     { "prepend", element_prepend },
@@ -514,13 +1897,54 @@ static luaL_Reg element_methods[] = {
     { "is_removed", element_is_removed },
     { "remove", element_remove },
     { "remove_and_keep_content", element_remove_and_keep_content },
+    { "set_user_value", element_set_user_value },
+    { "get_user_value", element_get_user_value },
+    { NULL, NULL }
+};
+
+/* end tag */
+static int end_tag_get_name(lua_State *L) {
+    const lol_html_end_tag_t **end_tag = check_valid_udata(L, 1, PREFIX "end_tag");
+    lol_html_str_t name = lol_html_end_tag_name_get(*end_tag);
+    lua_pushlstring(L, name.data, name.len);
+    lol_html_str_free(name);
+    return 1;
+}
+
+static int end_tag_before(lua_State *L) {
+    size_t len;
+    lol_html_end_tag_t **end_tag = check_valid_udata(L, 1, PREFIX "end_tag");
+    const char *text = luaL_checklstring(L, 2, &len);
+    bool is_html = lua_toboolean(L, 3);
+    return return_self_or_err(L, lol_html_end_tag_before(*end_tag, text, len, is_html));
+}
+
+static int end_tag_after(lua_State *L) {
+    size_t len;
+    lol_html_end_tag_t **end_tag = check_valid_udata(L, 1, PREFIX "end_tag");
+    const char *text = luaL_checklstring(L, 2, &len);
+    bool is_html = lua_toboolean(L, 3);
+    return return_self_or_err(L, lol_html_end_tag_after(*end_tag, text, len, is_html));
+}
+
+static int end_tag_remove(lua_State *L) {
+    lol_html_end_tag_t **end_tag = check_valid_udata(L, 1, PREFIX "end_tag");
+    lol_html_end_tag_remove(*end_tag);
+    return return_self_or_err(L, 0); /* cannot fail */
+}
+
+static const luaL_Reg end_tag_methods[] = {
+    { "get_name", end_tag_get_name },
+    { "before", end_tag_before },
+    { "after", end_tag_after },
+    { "remove", end_tag_remove },
     { NULL, NULL }
 };
 
 
 /* rewriter builder */
 /* note: as there is a dynamic number of callbacks, the userdata for the builder
- * is just a boxed pointer with a table as uservalue.
+ * is just a small lua_builder_t structure with a table as uservalue.
  * Each callback will also have a userdata associated with it, and the references
  * will be anchored with the table uservalue mentioned above.
  */
@@ -531,11 +1955,19 @@ static luaL_Reg element_methods[] = {
  */
 static int rewriter_builder_new(lua_State *L) {
     int builder_ref;
-    lol_html_rewriter_builder_t **ud = lua_newuserdata(L, sizeof(lol_html_rewriter_builder_t *));
-    *ud = lol_html_rewriter_builder_new();
+    module_metrics_t *metrics;
+    lua_builder_t *ud = lua_newuserdata(L, sizeof(lua_builder_t));
+    ud->builder = lol_html_rewriter_builder_new();
+    ud->active = NULL;
+    ud->handlers = ud->last_handler = NULL;
+    ud->nbuffers = 0;
+    ud->html_captures = 0;
 
     luaL_getmetatable(L, PREFIX "builder");
     lua_setmetatable(L, -2);
+    metrics = get_metrics(L);
+    metrics->builders++;
+    metrics->builders_total++;
 
     /* register the new builder in the builder registry */
     lua_getfield(L, LUA_REGISTRYINDEX, LOL_REGISTRY);  /* ud, reg */
@@ -555,30 +1987,153 @@ static int rewriter_builder_new(lua_State *L) {
 }
 
 static int rewriter_builder_destroy(lua_State *L) {
-    lol_html_rewriter_builder_t **ud = luaL_checkudata(L, 1, PREFIX "builder");
-    lol_html_rewriter_builder_free(*ud);
+    handler_data_t *handler;
+    module_metrics_t *metrics = get_metrics(L);
+    lua_builder_t *ud = luaL_checkudata(L, 1, PREFIX "builder");
+    lol_html_rewriter_builder_free(ud->builder);
+    /* the handlers are collected with the builder uservalue */
+    for (handler = ud->handlers; handler != NULL; handler = handler->next) {
+        metrics->handlers--;
+    }
+    metrics->builders--;
+    native_sync(L, false);
     return 0;
 }
 
-static handler_data_t* create_handler(lua_State *L, int builder_idx, int cb_table_idx, const char *field) {
-    if (lua_getfield(L, cb_table_idx, field) == LUA_TFUNCTION) {
-        handler_data_t *handler = lua_newuserdata(L, sizeof(handler_data_t)); /* func, hander_data */
+/* returns the number of attributes to record for element events, a private
+ * copy of the list is left on the stack (or nil): the handler points to its
+ * strings, so the caller must not be able to replace them */
+static size_t check_attributes(lua_State *L, int cb_table_idx, int type) {
+    size_t i, n;
+    if (type != HANDLER_ELEMENT) {
+        lua_pushnil(L);
+        return 0;
+    }
+    if (lua_getfield(L, cb_table_idx, "attributes") == LUA_TNIL) {
+        return 0;
+    }
+    luaL_checktype(L, -1, LUA_TTABLE);
+    n = lua_rawlen(L, -1);
+    lua_createtable(L, n, 0);
+    for (i = 1; i <= n; i++) {
+        /* the strings are referenced directly, they must not be converted */
+        if (lua_rawgeti(L, -2, i) != LUA_TSTRING) {
+            luaL_error(L, "attribute names must be strings");
+        }
+        lua_rawseti(L, -2, i);
+    }
+    lua_remove(L, -2);
+    return n;
+}
+
+static handler_data_t* create_handler(lua_State *L, int builder_idx, int cb_table_idx, const char *field,
+                                      int type, const char *selector) {
+    int cb_type = lua_getfield(L, cb_table_idx, field);
+    if (cb_type == LUA_TFUNCTION || (cb_type == LUA_TBOOLEAN && lua_toboolean(L, -1))) {
+        size_t i, nattributes = check_attributes(L, cb_table_idx, type);      /* func, attrs */
+        handler_data_t *handler = lua_newuserdata(L, sizeof(handler_data_t)   /* func, attrs, hander_data */
+                                                     + nattributes * sizeof(const char *));
+        lua_builder_t *builder = lua_touserdata(L, builder_idx);
+        module_metrics_t *metrics;
+        lua_Integer max_length;
         handler->L = L;
+        handler->builder = builder;
+        handler->type = type;
+        handler->selector = selector;
+        handler->calls = handler->errors = handler->time_ns = 0;
+        handler->next = NULL;
+        lua_getfield(L, cb_table_idx, "batch");
+        handler->batch = cb_type == LUA_TFUNCTION && lua_toboolean(L, -1);
+        handler->event = cb_type == LUA_TBOOLEAN || handler->batch;
+        lua_pop(L, 1);
+        handler->text_node = 0;
+        handler->buffer_index = -1;
+        handler->end_tag = NULL;
+        handler->slot = NULL;
+        if (type == HANDLER_END_TAG && handler->event) {
+            luaL_error(L, "end tag handlers must be functions");
+        }
+        if (type == HANDLER_TEXT) {
+            const char *mode;
+            lua_getfield(L, cb_table_idx, "text_handler_mode");
+            mode = lua_tostring(L, -1);
+            if (mode != NULL && strcmp(mode, "node") == 0) {
+                if (handler->event) {
+                    luaL_error(L, "text_handler_mode \"node\" is not supported for events");
+                }
+                handler->text_node = 1;
+            } else if (!lua_isnil(L, -1) && (mode == NULL || strcmp(mode, "chunk") != 0)) {
+                luaL_error(L, "invalid text_handler_mode");
+            }
+            lua_getfield(L, cb_table_idx, "max_text_length");
+            max_length = luaL_optinteger(L, -1, TEXT_NODE_DEFAULT_MAX_LENGTH);
+            luaL_argcheck(L, max_length >= 0, cb_table_idx, "max_text_length must be non-negative");
+            handler->max_length = max_length;
+            lua_pop(L, 2);
+        }
+        handler->capture = CAPTURE_NONE;
+        if (type == HANDLER_ELEMENT) {
+            const char *mode;
+            lua_getfield(L, cb_table_idx, "capture_content");
+            mode = lua_tostring(L, -1);
+            if (mode != NULL && strcmp(mode, "text") == 0) {
+                handler->capture = CAPTURE_TEXT;
+            } else if (mode != NULL && strcmp(mode, "html") == 0) {
+                handler->capture = CAPTURE_HTML;
+            } else if (!lua_isnil(L, -1)) {
+                luaL_error(L, "invalid capture_content");
+            }
+            if (handler->capture != CAPTURE_NONE && handler->event) {
+                luaL_error(L, "capture_content is not supported for events");
+            }
+            lua_getfield(L, cb_table_idx, "max_capture_length");
+            max_length = luaL_optinteger(L, -1, CAPTURE_DEFAULT_MAX_LENGTH);
+            luaL_argcheck(L, max_length >= 0, cb_table_idx, "max_capture_length must be non-negative");
+            handler->max_length = max_length;
+            lua_pop(L, 2);
+        }
+        handler->nattributes = nattributes;
+        for (i = 0; i < nattributes; i++) {
+            lua_rawgeti(L, -2, i + 1);
+            handler->attributes[i] = lua_tostring(L, -1);
+            lua_pop(L, 1);
+        }
+        metrics = get_metrics(L);
+        metrics->handlers++;
+        metrics->handlers_total++;
+        if (builder->last_handler == NULL) {
+            builder->handlers = handler;
+        } else {
+            builder->last_handler->next = handler;
+        }
+        builder->last_handler = handler;
+        if (handler->text_node || handler->capture != CAPTURE_NONE) {
+            handler->buffer_index = builder->nbuffers++;
+        }
+        if (handler->capture == CAPTURE_HTML) {
+            builder->html_captures++;
+        }
 
-        lua_getuservalue(L, builder_idx);                                     /* func, hander_data, uv */
-        lua_getfield(L, -1, "ref");                                           /* func, hander_data, uv, ref */
+        lua_getuservalue(L, builder_idx);                                     /* func, attrs, hander_data, uv */
+        lua_getfield(L, -1, "ref");                                           /* func, attrs, hander_data, uv, ref */
         handler->builder_index = lua_tointeger(L, -1);
-        lua_pop(L, 1);                                                        /* func, hander_data, uv */
+        lua_pop(L, 1);                                                        /* func, attrs, hander_data, uv */
 
         /* keep a reference to the callback function */
-        lua_pushvalue(L, -3);                                                 /* func, hander_data, uv, func */
-        handler->callback_index = luaL_ref(L, -2);                            /* func, hander_data, uv */
+        lua_pushvalue(L, -4);                                                 /* func, attrs, hander_data, uv, func */
+        handler->callback_index = luaL_ref(L, -2);                            /* func, attrs, hander_data, uv */
 
         /* keep a reference to the handler data (kept until the builder is GC'd */
-        lua_pushvalue(L, -2);                                                 /* func, hander_data, uv, hander_data */
-        luaL_ref(L, -2);                                                      /* func, hander_data, uv */
+        lua_pushvalue(L, -2);                                                 /* func, attrs, hander_data, uv, hander_data */
+        luaL_ref(L, -2);                                                      /* func, attrs, hander_data, uv */
+
+        /* and to the (copied) attribute names */
+        if (nattributes > 0) {
+            lua_pushvalue(L, -3);                                             /* func, attrs, hander_data, uv, attrs */
+            luaL_ref(L, -2);                                                  /* func, attrs, hander_data, uv */
+        }
 
-        lua_pop(L, 3);                                                        /* func */
+        lua_pop(L, 4);
         return handler;
     } else {
         // TODO: throw error if the handler is not a function
@@ -588,22 +2143,75 @@ static handler_data_t* create_handler(lua_State *L, int builder_idx, int cb_tabl
     }
 }
 
-static int rewriter_builder_add_document_content_handlers(lua_State *L) {
+/* registers the document content handlers found in the table at `cb_idx` to
+ * the builder at `builder_idx` (both indices must be absolute) */
+static void add_document_content_handlers(lua_State *L, int builder_idx, int cb_idx) {
     void *doctype_ud, *comment_ud, *text_ud, *doc_end_ud;
+    lua_builder_t *builder = lua_touserdata(L, builder_idx);
 
-    lol_html_rewriter_builder_t **builder = luaL_checkudata(L, 1, PREFIX "builder");
-    luaL_checktype(L, 2, LUA_TTABLE);
-    doctype_ud = create_handler(L, 1, 2, "doctype_handler");
-    comment_ud = create_handler(L, 1, 2, "comment_handler");
-    text_ud = create_handler(L, 1, 2, "text_handler");
-    doc_end_ud = create_handler(L, 1, 2, "doc_end_handler");
+    doctype_ud = create_handler(L, builder_idx, cb_idx, "doctype_handler", HANDLER_DOCTYPE, NULL);
+    comment_ud = create_handler(L, builder_idx, cb_idx, "comment_handler", HANDLER_COMMENT, NULL);
+    text_ud = create_handler(L, builder_idx, cb_idx, "text_handler", HANDLER_TEXT, NULL);
+    doc_end_ud = create_handler(L, builder_idx, cb_idx, "doc_end_handler", HANDLER_DOC_END, NULL);
 
     lol_html_rewriter_builder_add_document_content_handlers(
-            *builder,
+            builder->builder,
             (doctype_ud == NULL) ? NULL : doctype_handler, doctype_ud,
             (comment_ud == NULL) ? NULL : comment_handler, comment_ud,
             (text_ud == NULL) ? NULL : text_chunk_handler, text_ud,
             (doc_end_ud == NULL) ? NULL : doc_end_handler, doc_end_ud);
+}
+
+/* same as above for element content handlers, the selector (and its source)
+ * must be anchored by the caller */
+static int add_element_content_handlers(lua_State *L, int builder_idx, int cb_idx,
+                                        const lol_html_selector_t *selector, const char *source) {
+    void *comment_ud, *text_ud;
+    handler_data_t *element_ud, *end_tag_ud;
+    lol_html_element_handler_t element_cb = element_handler;
+    lua_builder_t *builder = lua_touserdata(L, builder_idx);
+
+    comment_ud = create_handler(L, builder_idx, cb_idx, "comment_handler", HANDLER_COMMENT, source);
+    text_ud = create_handler(L, builder_idx, cb_idx, "text_handler", HANDLER_TEXT, source);
+    element_ud = create_handler(L, builder_idx, cb_idx, "element_handler", HANDLER_ELEMENT, source);
+    end_tag_ud = create_handler(L, builder_idx, cb_idx, "end_tag_handler", HANDLER_END_TAG, source);
+
+    if (end_tag_ud != NULL) {
+        /* registered first, so that the slot is ready for the element
+         * handler */
+        if (lol_html_rewriter_builder_add_element_content_handlers(
+                    builder->builder, selector, end_tag_start_handler, end_tag_ud,
+                    NULL, NULL, NULL, NULL) != 0) {
+            return -1;
+        }
+        if (element_ud != NULL) {
+            element_ud->end_tag = end_tag_ud;
+        }
+    }
+
+    if (element_ud != NULL && element_ud->capture != CAPTURE_NONE) {
+        element_cb = capture_element_handler;
+        /* the captured text is collected by a separate registration, as the
+         * user text handler (if any) can run in chunk or node mode */
+        if (element_ud->capture == CAPTURE_TEXT
+                && lol_html_rewriter_builder_add_element_content_handlers(
+                    builder->builder, selector, NULL, NULL, NULL, NULL,
+                    capture_text_handler, element_ud) != 0) {
+            return -1;
+        }
+    }
+
+    return lol_html_rewriter_builder_add_element_content_handlers(
+            builder->builder, selector,
+            (element_ud == NULL) ? NULL : element_cb, element_ud,
+            (comment_ud == NULL) ? NULL : comment_handler, comment_ud,
+            (text_ud == NULL) ? NULL : text_chunk_handler, text_ud);
+}
+
+static int rewriter_builder_add_document_content_handlers(lua_State *L) {
+    luaL_checkudata(L, 1, PREFIX "builder");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    add_document_content_handlers(L, 1, 2);
 
     /* return self */
     lua_settop(L, 1);
@@ -611,11 +2219,9 @@ static int rewriter_builder_add_document_content_handlers(lua_State *L) {
 }
 
 static int rewriter_builder_add_element_content_handlers(lua_State *L) {
-    void *comment_ud, *text_ud, *element_ud;
-    const lol_html_selector_t **selector;
-    int rc;
+    const lua_selector_t *selector;
 
-    lol_html_rewriter_builder_t **builder = luaL_checkudata(L, 1, PREFIX "builder");
+    luaL_checkudata(L, 1, PREFIX "builder");
     luaL_checktype(L, 2, LUA_TTABLE);
 
     /* get selector, and anchor it to the builder */
@@ -625,176 +2231,779 @@ static int rewriter_builder_add_element_content_handlers(lua_State *L) {
     luaL_ref(L, -2);
     lua_pop(L, 1);
 
-    comment_ud = create_handler(L, 1, 2, "comment_handler");
-    text_ud = create_handler(L, 1, 2, "text_handler");
-    element_ud = create_handler(L, 1, 2, "element_handler");
+    return return_self_or_err(L, add_element_content_handlers(
+                L, 1, 2, selector->selector, selector->source));
+}
 
-    rc = lol_html_rewriter_builder_add_element_content_handlers(
-            *builder, *selector,
-            (element_ud == NULL) ? NULL : element_handler, element_ud,
-            (comment_ud == NULL) ? NULL : comment_handler, comment_ud,
-            (text_ud == NULL) ? NULL : text_chunk_handler, text_ud);
+/* returns the profiling data of all the handlers */
+static int rewriter_builder_profile(lua_State *L) {
+    handler_data_t *handler;
+    int i = 1;
+    lua_builder_t *builder = luaL_checkudata(L, 1, PREFIX "builder");
 
-    return return_self_or_err(L, rc);
+    lua_newtable(L);
+    for (handler = builder->handlers; handler != NULL; handler = handler->next) {
+        lua_createtable(L, 0, 5);
+        if (handler->selector != NULL) {
+            lua_pushstring(L, handler->selector);
+            lua_setfield(L, -2, "selector");
+        }
+        lua_pushstring(L, handler_type_names[handler->type]);
+        lua_setfield(L, -2, "type");
+        set_counter(L, "calls", handler->calls);
+        set_counter(L, "errors", handler->errors);
+        set_counter(L, "time_ns", handler->time_ns);
+        lua_rawseti(L, -2, i++);
+    }
+    return 1;
 }
 
-static luaL_Reg rewriter_builder_methods[] = {
+static const luaL_Reg rewriter_builder_methods[] = {
     { "add_document_content_handlers", rewriter_builder_add_document_content_handlers },
     { "add_element_content_handlers", rewriter_builder_add_element_content_handlers },
+    { "profile", rewriter_builder_profile },
     { NULL, NULL }
 };
 
 
 /* Rewriter */
-typedef struct {
-    lol_html_rewriter_t *rewriter;
-    lua_State *L;
-    int reg_idx;
-    bool broken; /* used to signal sink errors */
-} lua_rewriter_t;
+/* records a write as held back until the next output */
+static void latency_write(lua_rewriter_t *rewriter, size_t len) {
+    rewriter_latency_t *lat = &rewriter->latency;
+    if (lat->pending_len == lat->pending_cap) {
+        size_t cap = lat->pending_cap ? lat->pending_cap * 2 : 16;
+        uint64_t *pending = realloc(lat->pending, cap * sizeof(uint64_t));
+        if (pending == NULL) {
+            return; /* the write is just not accounted for */
+        }
+        lat->pending = pending;
+        lat->pending_cap = cap;
+    }
+    lat->pending[lat->pending_len++] = now_ns();
+    lat->held_bytes += len;
+    if (lat->held_bytes > lat->max_held_bytes) {
+        lat->max_held_bytes = lat->held_bytes;
+    }
+}
 
-static void sink_callback(const char *chunk, size_t chunk_len, void *user_data) {
-    int rc;
-    lua_rewriter_t *rewriter = user_data;
-    if (rewriter->broken) {
+/* releases all the held back writes, called when some output is produced */
+static void latency_release(lua_rewriter_t *rewriter) {
+    rewriter_latency_t *lat = &rewriter->latency;
+    uint64_t now, hold, us;
+    size_t i;
+    int bucket;
+
+    if (lat->pending_len == 0) {
         return;
     }
+    now = now_ns();
+    for (i = 0; i < lat->pending_len; i++) {
+        hold = now - lat->pending[i];
+        lat->total_ns += hold;
+        if (hold > lat->max_ns) {
+            lat->max_ns = hold;
+        }
+        for (bucket = 0, us = hold / 1000; us > 1 && bucket < LATENCY_BUCKETS - 1; us >>= 1) {
+            bucket++;
+        }
+        lat->histogram[bucket]++;
+    }
+    lat->released += lat->pending_len;
+    lat->pending_len = 0;
+    lat->held_bytes = 0;
+}
+
+/* stores a sink error for the current write */
+static void sink_error(lua_rewriter_t *rewriter, const char *msg) {
+    lua_getfield(rewriter->L, LUA_REGISTRYINDEX, LOL_REGISTRY);
+    lua_rawgeti(rewriter->L, -1, rewriter->reg_idx);
+    lua_pushstring(rewriter->L, msg);
+    set_rewriter_value(rewriter->L, -2, REWRITER_ERROR_INDEX);
+    lua_pop(rewriter->L, 2);
+    rewriter->broken = 1;
+}
 
-    lua_checkstack(rewriter->L, 4);
-    lua_getfield(rewriter->L, LUA_REGISTRYINDEX, LOL_REGISTRY); /* reg */
-    lua_rawgeti(rewriter->L, -1, rewriter->reg_idx);            /* reg, rewriter */
-    lua_getuservalue(rewriter->L, -1);                          /* reg, rewriter, uv */
-    lua_rawgeti(rewriter->L, -1, REWRITER_CALLBACK_INDEX);      /* reg, rewriter, uv, cb */
-    lua_pushlstring(rewriter->L, chunk, chunk_len);             /* reg, rewriter, uv, cb, chunk */
-    rc = lua_pcall(rewriter->L, 1, 0, 0);                       /* reg, rewriter, uv, err? */
+/* passes a chunk of output to the sink (or the output buffer) */
+static void sink_output(lua_rewriter_t *rewriter, const char *chunk, size_t chunk_len) {
+    int rc, nargs = 1;
+    uint64_t start;
+    PROBE2(sink, rewriter, chunk_len);
+    STAT_ADD(rewriter, bytes_out, chunk_len);
+    if (rewriter->track_latency) {
+        latency_release(rewriter);
+    }
+    if (rewriter->broken) {
+        return;
+    }
+    if (rewriter->buffer_output) {
+        if (!grow_array((void **)&rewriter->output, &rewriter->output_cap,
+                        rewriter->output_len + chunk_len, 1)) {
+            sink_error(rewriter, "not enough memory");
+            return;
+        }
+        memcpy(rewriter->output + rewriter->output_len, chunk, chunk_len);
+        rewriter->output_len += chunk_len;
+        return;
+    }
+    STAT_ADD(rewriter, sink_calls, 1);
+
+    lua_checkstack(rewriter->L, 6);
+    lua_getfield(rewriter->L, LUA_REGISTRYINDEX, LOL_REGISTRY);     /* reg */
+    lua_rawgeti(rewriter->L, -1, rewriter->reg_idx);                /* reg, rewriter */
+    get_rewriter_value(rewriter->L, -1, REWRITER_CALLBACK_INDEX);   /* reg, rewriter, cb */
+    lua_pushlstring(rewriter->L, chunk, chunk_len);                 /* reg, rewriter, cb, chunk */
+    if (rewriter->has_context) {
+        get_rewriter_value(rewriter->L, -3, REWRITER_CONTEXT_INDEX); /* reg, rewriter, cb, chunk, ctx */
+        nargs = 2;
+    }
+    start = NEEDS_CLOCK(rewriter) ? now_ns() : 0;
+    rc = lua_pcall(rewriter->L, nargs, 0, 0);                       /* reg, rewriter, err? */
+    if (start != 0) {
+        uint64_t end = now_ns();
+        if (rewriter->timing) {
+            rewriter->timings.sink_ns += end - start;
+        }
+        trace_add(rewriter, TRACE_SINK, chunk_len, NULL, start, end);
+        if (rc != LUA_OK) {
+            trace_add(rewriter, TRACE_ERROR, TRACE_IN_SINK, NULL, end, end);
+        }
+    }
 
-    if (rc != LUA_OK) {                                         /* reg, rewriter, uv, err */
+    if (rc != LUA_OK) {                                             /* reg, rewriter, err */
         /* at this point, the lol-html API does not allow to abort the
          * processing straight away, so we have to let it continue until the
          * end. However the Lua handler will not be called again. */
-        lua_rawseti(rewriter->L, -2, REWRITER_ERROR_INDEX);     /* reg, rewriter, uv */
+        set_rewriter_value(rewriter->L, -2, REWRITER_ERROR_INDEX);  /* reg, rewriter */
         rewriter->broken = 1;
     }
 
-    lua_pop(rewriter->L, 3);
+    lua_pop(rewriter->L, 2);
+}
+
+/* appends output to the HTML captures */
+static void capture_feed(lua_rewriter_t *rewriter, const char *data, size_t len) {
+    handler_data_t *handler;
+    handler_buffer_t *buf;
+
+    for (handler = rewriter->builder->handlers; handler != NULL; handler = handler->next) {
+        if (handler->capture != CAPTURE_HTML || handler->buffer_index >= rewriter->nbuffers) {
+            continue;
+        }
+        buf = &rewriter->buffers[handler->buffer_index];
+        if (buf->depth > 0 && !capture_append(buf, data, len, handler->max_length)) {
+            sink_error(rewriter, "not enough memory");
+        }
+    }
+}
+
+/* sets the start of the element of a capture marker, its buffer index and
+ * stack position are in `str` ("INDEX:POS"), returns false if it is invalid */
+static bool capture_mark(lua_rewriter_t *rewriter, const char *str, size_t len) {
+    char tmp[48];
+    int index, n = 0;
+    size_t pos;
+    handler_buffer_t *buf;
+
+    if (len >= sizeof(tmp)) {
+        return false;
+    }
+    memcpy(tmp, str, len);
+    tmp[len] = '\0';
+    if (sscanf(tmp, "%d:%zu%n", &index, &pos, &n) != 2 || (size_t)n != len
+            || index < 0 || index >= rewriter->nbuffers) {
+        return false;
+    }
+    buf = &rewriter->buffers[index];
+    if (pos < buf->depth && buf->starts[pos] == CAPTURE_START_PENDING) {
+        buf->starts[pos] = buf->len;
+    }
+    return true;
+}
+
+/* feeds the HTML captures from the output and strips the capture markers,
+ * which can be anywhere in the chunks */
+static void capture_output(lua_rewriter_t *rewriter, const char *chunk, size_t chunk_len) {
+    char prefix[sizeof(CAPTURE_MARKER) + CAPTURE_NONCE_LEN + 1];
+    size_t prefix_len = 0, end_len = sizeof(CAPTURE_MARKER_END) - 1, len;
+    const char *marker, *end;
+
+    if (rewriter->capture_nonce[0] != '\0') {
+        prefix_len = snprintf(prefix, sizeof(prefix), CAPTURE_MARKER "%s:", rewriter->capture_nonce);
+    }
+    while (chunk_len > 0) {
+        marker = prefix_len > 0 ? memmem(chunk, chunk_len, prefix, prefix_len) : NULL;
+        end = marker != NULL ? memmem(marker + prefix_len, chunk_len - (marker - chunk) - prefix_len,
+                                      CAPTURE_MARKER_END, end_len) : NULL;
+        /* the content before the marker goes to the enclosing captures */
+        len = end != NULL ? (size_t)(marker - chunk) : chunk_len;
+        if (len > 0) {
+            capture_feed(rewriter, chunk, len);
+            sink_output(rewriter, chunk, len);
+        }
+        if (end == NULL) {
+            return;
+        }
+        if (!capture_mark(rewriter, marker + prefix_len, end - marker - prefix_len)) {
+            /* not one of ours, keep it */
+            capture_feed(rewriter, marker, end + end_len - marker);
+            sink_output(rewriter, marker, end + end_len - marker);
+        }
+        end += end_len;
+        chunk_len -= end - chunk;
+        chunk = end;
+    }
+}
+
+static void sink_callback(const char *chunk, size_t chunk_len, void *user_data) {
+    lua_rewriter_t *rewriter = user_data;
+    if (rewriter->builder->html_captures > 0) {
+        capture_output(rewriter, chunk, chunk_len);
+    } else {
+        sink_output(rewriter, chunk, chunk_len);
+    }
+}
+
+/* checks that the value at the top of the stack can be used as a sink */
+static void check_sink(lua_State *L, int arg) {
+    if (lua_type(L, -1) != LUA_TFUNCTION) {
+        /* not a function, check if it's a callable */
+        if (luaL_getmetafield(L, -1, "__call") == LUA_TNIL) {
+            luaL_argerror(L, arg, "field \"sink\" cannot be called");
+        }
+        lua_pop(L, 1);
+    }
+}
+
+static void record_event(lua_rewriter_t *rewriter, int type, const char *data, size_t len) {
+    unsigned char header[13];
+    uint64_t ts = type == RECORD_DOCUMENT ? 0 : now_ns() - rewriter->record_start;
+    int i;
+
+    header[0] = type;
+    for (i = 0; i < 8; i++) {
+        header[1 + i] = ts >> (8 * i);
+    }
+    for (i = 0; i < 4; i++) {
+        header[9 + i] = (uint32_t)len >> (8 * i);
+    }
+    fwrite(header, 1, sizeof(header), rewriter->record);
+    fwrite(data, 1, len, rewriter->record);
+}
+
+/* (re)creates the lol-html rewriter from the settings stored in the
+ * lua_rewriter_t structure. The previous one (if any) must have been freed. */
+static bool rewriter_build(lua_rewriter_t *rewriter) {
+    int i;
+    end_tag_slot_t *slot;
+    rewriter->broken = 0;
+    memset(&rewriter->stats, 0, sizeof(rewriter->stats));
+    memset(&rewriter->timings, 0, sizeof(rewriter->timings));
+    /* keep the pending buffer for the next document */
+    memset(&rewriter->latency.held_bytes, 0,
+           sizeof(rewriter->latency) - offsetof(rewriter_latency_t, held_bytes));
+    rewriter->latency.pending_len = 0;
+    rewriter->trace.len = 0;
+    /* keep the capture buffers for the next document */
+    rewriter->capture.len = rewriter->capture.nchunks = 0;
+    rewriter->capture.bytes_in = rewriter->capture.ns = 0;
+    rewriter->capture.truncated = 0;
+    events_clear(&rewriter->events);
+    rewriter->output_len = 0;
+    for (i = 0; i < rewriter->nbuffers; i++) {
+        rewriter->buffers[i].len = rewriter->buffers[i].depth = 0;
+    }
+    /* slots of elements left open by the previous document */
+    for (slot = rewriter->slots; slot != NULL; slot = slot->next) {
+        if (slot->used) {
+            slot_release(rewriter->L, rewriter, slot);
+        }
+    }
+    if (rewriter->record != NULL) {
+        rewriter->record_start = now_ns();
+        record_event(rewriter, RECORD_DOCUMENT, NULL, 0);
+    }
+    rewriter->rewriter = lol_html_rewriter_build(
+        rewriter->builder->builder,
+        rewriter->encoding, rewriter->encoding_len,
+        rewriter->memory_settings,
+        sink_callback, rewriter,
+        rewriter->strict
+    );
+    return rewriter->rewriter != NULL;
 }
 
 static int rewriter_new(lua_State *L) {
-    size_t encoding_len;
-    const char *encoding;
-    lol_html_memory_settings_t memory_settings;
     lua_rewriter_t *rewriter;
-    bool strict;
+    module_metrics_t *metrics;
 
     luaL_checktype(L, 1, LUA_TTABLE);
 
     /* the error messages for the luaL_opt* functions are not great in this case */
     lua_getfield(L, 1, "builder");
-    lol_html_rewriter_builder_t **builder = luaL_checkudata(L, -1, PREFIX "builder");
+    lua_builder_t *builder = luaL_checkudata(L, -1, PREFIX "builder");
     /* keep the builder on the stack */
 
+    /* without a sink, the output is returned by write and close */
+    lua_getfield(L, 1, "sink");
+    if (!lua_isnil(L, -1)) {
+        check_sink(L, 1);
+    }
+
+    rewriter = new_rewriter_userdata(L); /* builder, cb, ud */
+    rewriter->L = L;
+    rewriter->builder = builder;
+    rewriter->busy = 0;
+    rewriter->buffer_output = lua_isnil(L, -2);
+    rewriter->output = NULL;
+    rewriter->output_len = rewriter->output_cap = 0;
+
     lua_getfield(L, 1, "encoding");
-    encoding = luaL_optlstring(L, -1, "utf-8", &encoding_len);
+    rewriter->encoding = luaL_optlstring(L, -1, "utf-8", &rewriter->encoding_len);
     lua_pop(L, 1);
 
     lua_getfield(L, 1, "preallocated_parsing_buffer_size");
-    memory_settings.preallocated_parsing_buffer_size = luaL_optinteger(L, -1, 1024);
+    rewriter->memory_settings.preallocated_parsing_buffer_size = luaL_optinteger(L, -1, 1024);
     lua_pop(L, 1);
 
     lua_getfield(L, 1, "max_allowed_memory_usage");
-    memory_settings.max_allowed_memory_usage = luaL_optinteger(L, -1, SIZE_MAX);
+    rewriter->memory_settings.max_allowed_memory_usage = luaL_optinteger(L, -1, SIZE_MAX);
     lua_pop(L, 1);
 
     lua_getfield(L, 1, "strict");
-    strict = lua_toboolean(L, -1);
+    rewriter->strict = lua_toboolean(L, -1);
     lua_pop(L, 1);
 
-    // TODO: support a "blackhole" sink by default that avoids all the callback
-    // machinery
-    if (lua_getfield(L, 1, "sink") != LUA_TFUNCTION) {
-        /* not a function, check if it's a callable */
-        if (luaL_getmetafield(L, -1, "__call") == LUA_TNIL) {
-            luaL_argerror(L, 1, "field \"sink\" cannot be called");
+    lua_getfield(L, 1, "timing");
+    rewriter->timing = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "latency");
+    rewriter->track_latency = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    rewriter->latency.pending = NULL;
+    rewriter->latency.pending_cap = 0;
+
+    /* true for the default size, or the maximum number of events */
+    lua_getfield(L, 1, "trace");
+    rewriter->trace.events = NULL;
+    if (lua_isboolean(L, -1)) {
+        rewriter->trace.cap = lua_toboolean(L, -1) ? TRACE_DEFAULT_EVENTS : 0;
+    } else {
+        lua_Integer n = luaL_optinteger(L, -1, 0);
+        luaL_argcheck(L, n >= 0, 1, "trace must be a boolean or a non-negative number of events");
+        rewriter->trace.cap = n;
+    }
+    lua_pop(L, 1);
+
+    memset(&rewriter->events, 0, sizeof(rewriter->events));
+    rewriter->buffers = NULL;
+    rewriter->nbuffers = 0;
+    rewriter->slots = rewriter->free_slots = rewriter->end_tag_slot = NULL;
+    rewriter->capture_nonce[0] = '\0';
+    memset(&rewriter->capture, 0, sizeof(rewriter->capture));
+    if (lua_getfield(L, 1, "capture") != LUA_TNIL) {
+        luaL_checktype(L, -1, LUA_TTABLE);
+        rewriter_capture_t *cap = &rewriter->capture;
+        cap->enabled = 1;
+        lua_Integer max_bytes, max_callbacks;
+        lua_Number threshold_ms;
+        lua_getfield(L, -1, "max_bytes");
+        max_bytes = luaL_optinteger(L, -1, CAPTURE_DEFAULT_MAX_BYTES);
+        luaL_argcheck(L, max_bytes >= 0, 1, "capture max_bytes must not be negative");
+        cap->max_bytes = max_bytes;
+        lua_getfield(L, -2, "threshold_ms");
+        threshold_ms = luaL_optnumber(L, -1, 0);
+        luaL_argcheck(L, threshold_ms >= 0, 1, "capture threshold_ms must not be negative");
+        cap->threshold_ns = threshold_ms * 1e6;
+        lua_getfield(L, -3, "max_callbacks");
+        max_callbacks = luaL_optinteger(L, -1, 0);
+        luaL_argcheck(L, max_callbacks >= 0, 1, "capture max_callbacks must not be negative");
+        cap->max_callbacks = max_callbacks;
+        lua_getfield(L, -4, "hook");
+        cap->has_hook = !lua_isnil(L, -1);
+        lua_getfield(L, -5, "dir");
+        if (!cap->has_hook && lua_isnil(L, -1)) {
+            luaL_argerror(L, 1, "capture needs a dir or a hook");
         }
-        lua_pop(L, 1);
+        /* only checked here, it is copied once the rewriter can be collected */
+        if (!lua_isnil(L, -1)) {
+            luaL_checkstring(L, -1);
+        }
+        lua_pop(L, 5);
     }
+    lua_pop(L, 1);
 
-    rewriter = lua_newuserdata(L, sizeof(lua_rewriter_t)); /* builder, cb, ud */
-    rewriter->L = L;
-    rewriter->broken = 0;
-    rewriter->rewriter = lol_html_rewriter_build(
-        *builder,
-        encoding, encoding_len,
-        memory_settings,
-        sink_callback, rewriter,
-        strict
-    );
+    rewriter->record = NULL;
+    if (lua_getfield(L, 1, "record") != LUA_TNIL) {
+        const char *path = luaL_checkstring(L, -1);
+        /* documents are appended to existing recordings */
+        rewriter->record = fopen(path, "ab");
+        if (rewriter->record == NULL) {
+            return luaL_fileresult(L, 0, path);
+        }
+        /* the initial position of append streams is implementation-defined */
+        if (fseek(rewriter->record, 0, SEEK_END) == 0 && ftell(rewriter->record) == 0) {
+            fputs(RECORD_MAGIC, rewriter->record);
+        }
+    }
+    lua_pop(L, 1);
+
+    if (!rewriter_build(rewriter)) {
+        if (rewriter->record != NULL) {
+            fclose(rewriter->record);
+        }
+        return push_last_error(L);
+    }
+
+    if (rewriter->trace.cap > 0) {
+        rewriter->trace.events = malloc(rewriter->trace.cap * sizeof(trace_event_t));
+        if (rewriter->trace.events == NULL) {
+            lol_html_rewriter_free(rewriter->rewriter);
+            if (rewriter->record != NULL) {
+                fclose(rewriter->record);
+            }
+            return luaL_error(L, "not enough memory");
+        }
+    }
+
+    // keep a reference of the rewriter in the weak registry to retrieve the
+    // reference later on
+    lua_getfield(L, LUA_REGISTRYINDEX, LOL_REGISTRY); /* builder, cb, ud, reg */
+    lua_pushvalue(L, -2);                             /* builder, cb, ud, reg, ud */
+    rewriter->reg_idx = luaL_ref(L, -2);              /* builder, cb, ud, reg */
+    lua_pop(L, 1);                                    /* builder, cb, ud */
+
+    /* attach the buidler, handler functions and context to the userdata */
+    lua_pushvalue(L, -2);                             /* builder, cb, ud, cb */
+    set_rewriter_value(L, -2, REWRITER_CALLBACK_INDEX); /* builder, cb, ud */
+    lua_pushvalue(L, -3);                             /* builder, cb, ud, builder */
+    set_rewriter_value(L, -2, REWRITER_BUILDER_INDEX); /* builder, cb, ud */
+    lua_getfield(L, 1, "context");                    /* builder, cb, ud, ctx */
+    rewriter->has_context = !lua_isnil(L, -1);
+    set_rewriter_value(L, -2, REWRITER_CONTEXT_INDEX); /* builder, cb, ud */
+    /* anchor the encoding string for subsequent resets */
+    lua_pushlstring(L, rewriter->encoding, rewriter->encoding_len);
+    rewriter->encoding = lua_tostring(L, -1);
+    set_rewriter_value(L, -2, REWRITER_ENCODING_INDEX); /* builder, cb, ud */
+    if (rewriter->capture.has_hook) {
+        lua_getfield(L, 1, "capture");                /* builder, cb, ud, capture */
+        lua_getfield(L, -1, "hook");                  /* builder, cb, ud, capture, hook */
+        set_rewriter_value(L, -3, REWRITER_CAPTURE_INDEX); /* builder, cb, ud, capture */
+        lua_pop(L, 1);                                /* builder, cb, ud */
+    }
+
+    luaL_getmetatable(L, PREFIX "rewriter");          /* builder, cb, ud, mt */
+    lua_setmetatable(L, -2);                          /* builder, cb, ud */
+
+    /* the rewriter is now released by the GC, errors can't leak the copy */
+    if (rewriter->capture.enabled) {
+        lua_getfield(L, 1, "capture");                /* builder, cb, ud, capture */
+        if (lua_getfield(L, -1, "dir") != LUA_TNIL    /* builder, cb, ud, capture, dir */
+                && (rewriter->capture.dir = copy_string(lua_tostring(L, -1))) == NULL) {
+            return luaL_error(L, "not enough memory");
+        }
+        lua_pop(L, 2);                                /* builder, cb, ud */
+    }
+
+    metrics = get_metrics(L);
+    metrics->rewriters++;
+    metrics->rewriters_total++;
+    metrics->documents_total++;
+    PROBE1(rewriter_create, rewriter);
+    native_sync(L, true);
+    return 1;
+}
+
+/* Prepares the rewriter for a new document, reusing the Lua objects and
+ * settings of the previous one. A new sink and context can be given. */
+static int rewriter_reset(lua_State *L) {
+    lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+    }
+    if (rewriter->busy) {
+        return luaL_error(L, "cannot reset a rewriter while it is processing data");
+    }
+    lua_settop(L, 2);
+
+    if (lua_istable(L, 2)) {
+        if (lua_getfield(L, 2, "sink") != LUA_TNIL) { /* self, opts, cb */
+            if (rewriter->buffer_output) {
+                luaL_argerror(L, 2, "rewriter created without a sink");
+            }
+            check_sink(L, 2);
+            set_rewriter_value(L, 1, REWRITER_CALLBACK_INDEX);
+        } else {
+            lua_pop(L, 1);
+        }
+        lua_getfield(L, 2, "context");                /* self, opts, ctx */
+    } else {
+        lua_pushnil(L);                               /* self, opts, nil */
+    }
+    rewriter->has_context = !lua_isnil(L, -1);
+    set_rewriter_value(L, 1, REWRITER_CONTEXT_INDEX); /* self, opts */
+    lua_pushnil(L);
+    set_rewriter_value(L, 1, REWRITER_ERROR_INDEX);
+
+    /* abandon the current document if it wasn't closed */
+    if (rewriter->rewriter != NULL) {
+        lol_html_rewriter_free(rewriter->rewriter);
+        rewriter->rewriter = NULL;
+    }
+
+    if (!rewriter_build(rewriter)) {
+        return push_last_error(L);
+    }
+    get_metrics(L)->documents_total++;
+    native_sync(L, true);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int return_self_or_stack_error(lua_State *L, int rc, int prev_top, lua_rewriter_t *rewriter) {
+    if (rc == 0) {
+        assert(lua_gettop(L) == prev_top);
+
+        if (!rewriter->broken) {
+            /* all good */
+            lua_settop(L, 1);
+            if (rewriter->buffer_output) {
+                lua_pushlstring(L, rewriter->output ? rewriter->output : "", rewriter->output_len);
+                rewriter->output_len = 0;
+            }
+            return 1;
+        }
+
+        /* rc == 0 but rewriter->broken: the sink threw an error.
+         * Fetch the error and leave it on top of the stack */
+        get_rewriter_value(L, 1, REWRITER_ERROR_INDEX);
+        assert(!lua_isnil(L, -1));
+    }
+
+    /* error case: if the Lua stack moved, that was a Lua runtime error, and
+     * the error value is at the top of the stack already, otherwise it is a
+     * lolhtml error */
+    if (lua_gettop(L) == prev_top) {
+        /* lolhtml error: take it before calling lol-html again */
+        push_last_error(L);
+    } else {
+        /* Lua runtime error */
+        lua_pushnil(L);
+        lua_pushvalue(L, -2);
+    }
+
+    /* the rewriter is broken: free it now and leave a NULL pointer to signal
+     * that, its pending output is dropped */
+    rewriter->output_len = 0;
+    lol_html_rewriter_free(rewriter->rewriter);
+    rewriter->rewriter = NULL;
+    return 2;
+}
+
+/* keeps a written chunk, up to the size limit */
+static void capture_write(lua_rewriter_t *rewriter, const char *chunk, size_t len, uint64_t ns) {
+    rewriter_capture_t *cap = &rewriter->capture;
+    size_t kept = len;
+
+    cap->bytes_in += len;
+    cap->ns += ns;
+    if (cap->truncated) {
+        return;
+    }
+    if (cap->len + kept > cap->max_bytes) {
+        kept = cap->max_bytes - cap->len;
+        cap->truncated = 1;
+        if (kept == 0) {
+            return;
+        }
+    }
+    if (cap->len + kept > cap->cap) {
+        size_t size = cap->cap ? cap->cap : 16 * 1024;
+        char *data;
+        while (size < cap->len + kept) size *= 2;
+        if (size > cap->max_bytes) size = cap->max_bytes;
+        if ((data = realloc(cap->data, size)) == NULL) {
+            cap->truncated = 1;
+            return;
+        }
+        cap->data = data;
+        cap->cap = size;
+    }
+    if (cap->nchunks == cap->chunks_cap) {
+        size_t size = cap->chunks_cap ? cap->chunks_cap * 2 : 64;
+        capture_chunk_t *chunks = realloc(cap->chunks, size * sizeof(capture_chunk_t));
+        if (chunks == NULL) {
+            cap->truncated = 1;
+            return;
+        }
+        cap->chunks = chunks;
+        cap->chunks_cap = size;
+    }
+    memcpy(cap->data + cap->len, chunk, kept);
+    cap->len += kept;
+    cap->chunks[cap->nchunks].len = kept;
+    cap->chunks[cap->nchunks].ns = ns;
+    cap->nchunks++;
+}
 
-    if (rewriter->rewriter == NULL) {
-        return push_last_error(L);
+/* writes the captured input as <dir>/lolhtml-<pid>-<time>.html, with the
+ * chunk boundaries and timings in a .json file next to it. This is best
+ * effort: errors are ignored. */
+static atomic_ulong capture_files;
+
+static void capture_write_files(lua_rewriter_t *rewriter, uint64_t callbacks) {
+    rewriter_capture_t *cap = &rewriter->capture;
+    char path[4096];
+    size_t i, base;
+    FILE *f;
+
+    /* the wall clock and the pid make the names unique across processes, the
+     * counter within the process */
+    base = snprintf(path, sizeof(path) - 5, "%s/lolhtml-%lld-%ld-%lu", cap->dir,
+                    (long long)time(NULL), (long)getpid(),
+                    atomic_fetch_add(&capture_files, 1));
+    if (base >= sizeof(path) - 5) {
+        return;
     }
+    strcpy(path + base, ".html");
+    if ((f = fopen(path, "wb")) == NULL) {
+        return;
+    }
+    fwrite(cap->data, 1, cap->len, f);
+    fclose(f);
 
-    // keep a reference of the rewriter in the weak registry to retrieve the
-    // reference later on
-    lua_getfield(L, LUA_REGISTRYINDEX, LOL_REGISTRY); /* builder, cb, ud, reg */
-    lua_pushvalue(L, -2);                             /* builder, cb, ud, reg, ud */
-    rewriter->reg_idx = luaL_ref(L, -2);              /* builder, cb, ud, reg */
-    lua_pop(L, 1);                                    /* builder, cb, ud */
+    strcpy(path + base, ".json");
+    if ((f = fopen(path, "w")) == NULL) {
+        return;
+    }
+    fprintf(f, "{\"bytes_in\":%llu,\"captured\":%zu,\"truncated\":%s,"
+               "\"total_ns\":%llu,\"callbacks\":%llu,\"chunks\":[",
+            (unsigned long long)cap->bytes_in, cap->len, cap->truncated ? "true" : "false",
+            (unsigned long long)cap->ns, (unsigned long long)callbacks);
+    for (i = 0; i < cap->nchunks; i++) {
+        fprintf(f, "%s{\"len\":%zu,\"ns\":%llu}", i ? "," : "",
+                cap->chunks[i].len, (unsigned long long)cap->chunks[i].ns);
+    }
+    fputs("]}\n", f);
+    fclose(f);
+}
 
-    /* attach the buidler and handler functions to the userdata */
-    lua_createtable(L, 2, 0);                         /* builder, cb, ud, uv */
-    lua_pushvalue(L, -3);                             /* builder, cb, ud, uv, cb */
-    lua_rawseti(L, -2, REWRITER_CALLBACK_INDEX);      /* builder, cb, ud, uv */
-    lua_pushvalue(L, -4);                             /* builder, cb, ud, uv, builder */
-    lua_rawseti(L, -2, REWRITER_BUILDER_INDEX);       /* builder, cb, ud, uv */
-    lua_setuservalue(L, -2);                          /* builder, cb, ud */
+/* called after `close`: dumps the captured input if the document was slow.
+ * The hook is called unprotected, its errors are propagated to the caller. */
+static void capture_finish(lua_State *L, lua_rewriter_t *rewriter) {
+    rewriter_capture_t *cap = &rewriter->capture;
+    uint64_t callbacks = 0;
+    size_t i;
 
-    luaL_getmetatable(L, PREFIX "rewriter");          /* builder, cb, ud, mt */
-    lua_setmetatable(L, -2);                          /* builder, cb, ud */
+    for (i = 0; i < HANDLER_TYPES_COUNT; i++) {
+        callbacks += rewriter->stats.callbacks[i];
+    }
+    /* without any criteria, all documents are captured */
+    if ((cap->threshold_ns || cap->max_callbacks)
+            && !(cap->threshold_ns && cap->ns >= cap->threshold_ns)
+            && !(cap->max_callbacks && callbacks >= cap->max_callbacks)) {
+        return;
+    }
 
-    return 1;
+    if (cap->dir != NULL) {
+        capture_write_files(rewriter, callbacks);
+    }
+    if (cap->has_hook) {
+        push_rewriter_field(L, rewriter, REWRITER_CAPTURE_INDEX);
+        lua_createtable(L, 0, 6);
+        lua_pushlstring(L, cap->data ? cap->data : "", cap->len);
+        lua_setfield(L, -2, "data");
+        lua_pushboolean(L, cap->truncated);
+        lua_setfield(L, -2, "truncated");
+        set_counter(L, "bytes_in", cap->bytes_in);
+        set_counter(L, "total_ns", cap->ns);
+        set_counter(L, "callbacks", callbacks);
+        lua_createtable(L, cap->nchunks, 0);
+        for (i = 0; i < cap->nchunks; i++) {
+            lua_createtable(L, 0, 2);
+            set_counter(L, "len", cap->chunks[i].len);
+            set_counter(L, "ns", cap->chunks[i].ns);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_setfield(L, -2, "chunks");
+        lua_call(L, 1, 0);
+    }
 }
 
-static int return_self_or_stack_error(lua_State *L, int rc, int prev_top, lua_rewriter_t *rewriter) {
-    if (rc == 0) {
-        assert(lua_gettop(L) == prev_top);
+/* calls the batch handlers with the events queued during a write or close.
+ * In case of error, it is left on the stack. */
+static int call_batch_handlers(lua_State *L, lua_rewriter_t *rewriter) {
+    event_buffer_t *buf = &rewriter->events;
+    handler_data_t *handler;
+    size_t i;
+    int n, rc = LUA_OK;
+
+    rewriter->busy = 1;
+    for (handler = rewriter->builder->handlers; handler != NULL && rc == LUA_OK; handler = handler->next) {
+        if (!handler->batch) {
+            continue;
+        }
+        lua_newtable(L);                                  /* events */
+        for (i = 0, n = 0; i < buf->len; i++) {
+            if (buf->events[i].handler == handler) {
+                lua_createtable(L, 0, 5);
+                push_event_fields(L, buf, &buf->events[i]);
+                lua_rawseti(L, -2, ++n);
+            }
+        }
+        if (n == 0) {
+            lua_pop(L, 1);
+            continue;
+        }
 
-        if (!rewriter->broken) {
-            /* all good */
-            lua_settop(L, 1);
-            return 1;
+        /* same as do_document_content_callback */
+        lua_getfield(L, LUA_REGISTRYINDEX, LOL_REGISTRY); /* events, reg */
+        lua_rawgeti(L, -1, handler->builder_index);       /* events, reg, ud */
+        lua_getuservalue(L, -1);                          /* events, reg, ud, uv */
+        lua_rawgeti(L, -1, handler->callback_index);      /* events, reg, ud, uv, cb */
+        lua_replace(L, -4);                               /* events, cb, ud, uv */
+        lua_pop(L, 2);                                    /* events, cb */
+        lua_insert(L, -2);                                /* cb, events */
+        if (rewriter->has_context) {
+            push_rewriter_field(L, rewriter, REWRITER_CONTEXT_INDEX);
         }
 
-        /* rc == 0 but rewriter->broken: the sink threw an error.
-         * Fetch the error and leave it on top of the stack */
-        lua_getuservalue(L, 1);
-        lua_rawgeti(L, -1, REWRITER_ERROR_INDEX);
-        assert(!lua_isnil(L, -1));
+        uint64_t start = rewriter->timing ? now_ns() : 0;
+        rc = lua_pcall(L, rewriter->has_context ? 2 : 1, 0, 0);
+        if (start != 0) {
+            uint64_t ns = now_ns() - start;
+            rewriter->timings.handler_ns += ns;
+            handler->time_ns += ns;
+        }
+        if (rc != LUA_OK) {
+            handler->errors++;
+        }
     }
+    rewriter->busy = 0;
+    return rc;
+}
 
-    /* the rewriter is broken: free it now and leave a NULL pointer to signal
-     * that */
-    lol_html_rewriter_free(rewriter->rewriter);
-    rewriter->rewriter = NULL;
-
-    /* error case: if the Lua stack moved, that was a Lua runtime error, and
-     * the error value is at the top of the stack already, otherwise it is a
-     * lolhtml error */
-    if (lua_gettop(L) == prev_top) {
-        /* lolhtml error */
-        return push_last_error(L);
+/* accounts for a lol-html call started at `start` */
+static uint64_t rewriter_timed(lua_rewriter_t *rewriter, int kind, size_t len, int rc, uint64_t start) {
+    uint64_t end = now_ns();
+    if (rewriter->timing) {
+        rewriter->timings.total_ns += end - start;
     }
-
-    /* Lua runtime error */
-    lua_pushnil(L);
-    lua_pushvalue(L, -2);
-    return 2;
+    trace_add(rewriter, kind, len, NULL, start, end);
+    if (rc != 0) {
+        /* lol-html error, or the error of a handler */
+        trace_add(rewriter, TRACE_ERROR, TRACE_IN_REWRITER, NULL, end, end);
+    }
+    return end - start;
 }
 
 static int rewriter_write(lua_State *L) {
     const char *chunk;
     size_t chunk_len;
     int top, rc;
+    uint64_t start;
+    lua_rewriter_t *prev_active;
 
     lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
     if (rewriter->rewriter == NULL) {
@@ -804,13 +3013,49 @@ static int rewriter_write(lua_State *L) {
     }
 
     chunk = luaL_checklstring(L, 2, &chunk_len);
+    if (rewriter->record != NULL && chunk_len > UINT32_MAX) {
+        /* the record length is 32 bits */
+        lua_pushnil(L);
+        lua_pushliteral(L, "chunk too large to be recorded");
+        return 2;
+    }
+    STAT_ADD(rewriter, writes, 1);
+    STAT_ADD(rewriter, bytes_in, chunk_len);
+    if (rewriter->track_latency) {
+        latency_write(rewriter, chunk_len);
+    }
+    if (rewriter->record != NULL) {
+        record_event(rewriter, RECORD_WRITE, chunk, chunk_len);
+    }
+    events_clear(&rewriter->events);
     top = lua_gettop(L);
+    prev_active = rewriter->builder->active;
+    rewriter->builder->active = rewriter;
+    rewriter->busy = 1;
+    PROBE2(write_start, rewriter, chunk_len);
+    start = NEEDS_CLOCK(rewriter) ? now_ns() : 0;
     rc = lol_html_rewriter_write(rewriter->rewriter, chunk, chunk_len);
+    PROBE2(write_done, rewriter, rc);
+    rewriter->busy = 0;
+    rewriter->builder->active = prev_active;
+    if (rc == 0 && rewriter->events.len > 0 && call_batch_handlers(L, rewriter) != LUA_OK) {
+        rc = -1; /* the error is on the stack */
+    }
+    /* after the batch handlers, their time is counted in handler_ns */
+    if (start != 0) {
+        uint64_t ns = rewriter_timed(rewriter, TRACE_WRITE, chunk_len, rc, start);
+        if (rewriter->capture.enabled) {
+            capture_write(rewriter, chunk, chunk_len, ns);
+        }
+    }
+    native_sync(L, true);
     return return_self_or_stack_error(L, rc, top, rewriter);
 }
 
 static int rewriter_end(lua_State *L) {
-    int top, rc;
+    int top, rc, nret;
+    uint64_t start;
+    lua_rewriter_t *prev_active;
 
     lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
     if (rewriter->rewriter == NULL) {
@@ -819,7 +3064,34 @@ static int rewriter_end(lua_State *L) {
         return 2;
     }
     top = lua_gettop(L);
+    if (rewriter->record != NULL) {
+        record_event(rewriter, RECORD_CLOSE, NULL, 0);
+        fflush(rewriter->record);
+    }
+    events_clear(&rewriter->events);
+    prev_active = rewriter->builder->active;
+    rewriter->builder->active = rewriter;
+    rewriter->busy = 1;
+    start = NEEDS_CLOCK(rewriter) ? now_ns() : 0;
     rc = lol_html_rewriter_end(rewriter->rewriter);
+    if (rc == 0 && !rewriter->broken && !capture_close_pending(rewriter)) {
+        rc = -1; /* the error is on the stack */
+    }
+    rewriter->busy = 0;
+    rewriter->builder->active = prev_active;
+    if (rewriter->track_latency) {
+        /* anything still held back is released by the end of the document */
+        latency_release(rewriter);
+    }
+    if (rc == 0 && rewriter->events.len > 0 && call_batch_handlers(L, rewriter) != LUA_OK) {
+        rc = -1; /* the error is on the stack */
+    }
+    /* after the pending captures and batch handlers, they are part of the
+     * close */
+    if (start != 0) {
+        uint64_t ns = rewriter_timed(rewriter, TRACE_CLOSE, 0, rc, start);
+        rewriter->capture.ns += ns;
+    }
 
     /* destroy it anyway, otherwise calling the rewriter again will abort */
     if (rc == 0) {
@@ -827,21 +3099,292 @@ static int rewriter_end(lua_State *L) {
         rewriter->rewriter = NULL;
     }
 
-    return return_self_or_stack_error(L, rc, top, rewriter);
+    native_sync(L, true);
+    nret = return_self_or_stack_error(L, rc, top, rewriter);
+    if (rewriter->capture.enabled) {
+        capture_finish(L, rewriter);
+    }
+    return nret;
+}
+
+static int rewriter_events_next(lua_State *L) {
+    lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
+    event_buffer_t *buf = &rewriter->events;
+
+    /* events of batch handlers are not returned */
+    while (buf->pos < buf->len && buf->events[buf->pos].handler->batch) {
+        buf->pos++;
+    }
+    if (buf->pos >= buf->len) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (buf->reuse && lua_istable(L, 2)) {
+        /* clear the previous event */
+        lua_settop(L, 2);
+        clear_table(L, 2);
+    } else {
+        lua_createtable(L, 0, 5);
+    }
+    push_event_fields(L, buf, &buf->events[buf->pos++]);
+    return 1;
+}
+
+/* writes a chunk (or closes the document without one) and returns an
+ * iterator over the events queued meanwhile. Errors are raised, as this is
+ * meant to be used in a for loop. */
+static int rewriter_events(lua_State *L) {
+    lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
+    bool closing = lua_isnoneornil(L, 2);
+    /* the output can't be returned along with the iterator: the fourth value
+     * of a generic for is a to-be-closed variable in Lua 5.4 */
+    luaL_argcheck(L, !rewriter->buffer_output, 1, "events need a rewriter with a sink");
+    if (!closing) {
+        luaL_checkstring(L, 2);
+    }
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    lua_settop(L, 3);
+
+    lua_pushcfunction(L, closing ? rewriter_end : rewriter_write);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_call(L, closing ? 1 : 2, 2);
+    if (lua_isnil(L, -2)) {
+        return lua_error(L);
+    }
+
+    rewriter->events.pos = 0;
+    rewriter->events.reuse = !lua_isnil(L, 3);
+    lua_pushcfunction(L, rewriter_events_next);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 3);
+    return 3;
+}
+
+static int rewriter_stats(lua_State *L) {
+    int i;
+    uint64_t total = 0;
+    lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
+
+    /* fill the table given by the caller to avoid allocations */
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        lua_createtable(L, 0, 10);
+    } else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_settop(L, 2);
+    }
+
+    set_counter(L, "bytes_in", rewriter->stats.bytes_in);
+    set_counter(L, "bytes_out", rewriter->stats.bytes_out);
+    set_counter(L, "writes", rewriter->stats.writes);
+    set_counter(L, "sink_calls", rewriter->stats.sink_calls);
+    for (i = 0; i < HANDLER_TYPES_COUNT; i++) {
+        set_counter(L, handler_stat_fields[i], rewriter->stats.callbacks[i]);
+        total += rewriter->stats.callbacks[i];
+    }
+    set_counter(L, "callbacks", total);
+    return 1;
+}
+
+static int rewriter_timings(lua_State *L) {
+    lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
+    rewriter_timings_t *t = &rewriter->timings;
+    uint64_t outside_ns;
+
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        lua_createtable(L, 0, 4);
+    } else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_settop(L, 2);
+    }
+
+    /* handlers and sink are called within the measured calls, so the
+     * remaining time is spent in the parser itself (or the binding). The clock
+     * reads are not atomic, so the difference is clamped. */
+    outside_ns = t->handler_ns + t->sink_ns;
+    set_counter(L, "parser_ns", t->total_ns > outside_ns ? t->total_ns - outside_ns : 0);
+    set_counter(L, "handler_ns", t->handler_ns);
+    set_counter(L, "sink_ns", t->sink_ns);
+    set_counter(L, "total_ns", t->total_ns);
+    return 1;
+}
+
+static int rewriter_latency(lua_State *L) {
+    lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
+    rewriter_latency_t *lat = &rewriter->latency;
+
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        lua_createtable(L, 0, 6);
+    } else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_settop(L, 2);
+    }
+
+    set_counter(L, "held_bytes", lat->held_bytes);
+    set_counter(L, "held_writes", lat->pending_len);
+    set_counter(L, "max_held_bytes", lat->max_held_bytes);
+    set_counter(L, "released_writes", lat->released);
+    set_counter(L, "max_hold_ns", lat->max_ns);
+    set_counter(L, "mean_hold_ns", lat->released ? lat->total_ns / lat->released : 0);
+    return 1;
+}
+
+static int rewriter_latency_histogram(lua_State *L) {
+    int i;
+    lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
+
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        lua_createtable(L, LATENCY_BUCKETS, 0);
+    } else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_settop(L, 2);
+    }
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        lua_pushinteger(L, (lua_Integer)rewriter->latency.histogram[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
 }
 
 static int rewriter_destroy(lua_State *L) {
+    int i;
     lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
+    PROBE1(rewriter_destroy, rewriter);
+    get_metrics(L)->rewriters--;
     if (rewriter->rewriter != NULL) {
         lol_html_rewriter_free(rewriter->rewriter);
         rewriter->rewriter = NULL;
     }
+    free(rewriter->latency.pending);
+    rewriter->latency.pending = NULL;
+    free(rewriter->trace.events);
+    rewriter->trace.events = NULL;
+    free(rewriter->capture.data);
+    free(rewriter->capture.chunks);
+    free(rewriter->capture.dir);
+    rewriter->capture.data = rewriter->capture.dir = NULL;
+    rewriter->capture.chunks = NULL;
+    if (rewriter->record != NULL) {
+        fclose(rewriter->record);
+        rewriter->record = NULL;
+    }
+    free(rewriter->events.events);
+    free(rewriter->events.attrs);
+    free(rewriter->events.data);
+    memset(&rewriter->events, 0, sizeof(rewriter->events));
+    free(rewriter->output);
+    rewriter->output = NULL;
+    for (i = 0; i < rewriter->nbuffers; i++) {
+        free(rewriter->buffers[i].data);
+        free(rewriter->buffers[i].starts);
+    }
+    free(rewriter->buffers);
+    rewriter->buffers = NULL;
+    rewriter->nbuffers = 0;
+    while (rewriter->slots != NULL) {
+        end_tag_slot_t *slot = rewriter->slots;
+        rewriter->slots = slot->next;
+        free(slot);
+    }
+    rewriter->free_slots = NULL;
+    native_sync(L, false);
     return 0;
 }
 
-static luaL_Reg rewriter_methods[] = {
+static void write_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+/* writes the recorded events as Chrome trace-event JSON, loadable in
+ * chrome://tracing or Perfetto */
+static int rewriter_dump_trace(lua_State *L) {
+    lua_rewriter_t *rewriter = luaL_checkudata(L, 1, PREFIX "rewriter");
+    const char *path = luaL_checkstring(L, 2);
+    rewriter_trace_t *trace = &rewriter->trace;
+    size_t i, first, count;
+    FILE *f;
+
+    if (trace->events == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "tracing is not enabled");
+        return 2;
+    }
+    f = fopen(path, "w");
+    if (f == NULL) {
+        return luaL_fileresult(L, 0, path);
+    }
+
+    count = trace->len < trace->cap ? trace->len : trace->cap;
+    first = trace->len - count;
+    fputs("{\"traceEvents\":[", f);
+    for (i = 0; i < count; i++) {
+        trace_event_t *ev = &trace->events[(first + i) % trace->cap];
+        const char *name;
+        fputs(i ? ",\n" : "\n", f);
+        switch (ev->kind) {
+        case TRACE_WRITE: name = "write"; break;
+        case TRACE_CLOSE: name = "close"; break;
+        case TRACE_SINK: name = "sink"; break;
+        case TRACE_CALLBACK: name = handler_type_names[ev->arg]; break;
+        default: name = "error";
+        }
+        fprintf(f, "{\"name\":\"%s\",\"cat\":\"lolhtml\",\"pid\":1,\"tid\":1,"
+                   "\"ts\":%.3f,", name, ev->start / 1e3);
+        if (ev->kind == TRACE_ERROR) {
+            /* instant event, arg tells where the error happened */
+            fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"args\":{\"in\":\"%s\"",
+                    ev->arg < HANDLER_TYPES_COUNT ? handler_type_names[ev->arg]
+                    : ev->arg == TRACE_IN_SINK ? "sink" : "rewriter");
+        } else {
+            fprintf(f, "\"ph\":\"X\",\"dur\":%.3f,\"args\":{", (ev->end - ev->start) / 1e3);
+            if (ev->kind != TRACE_CALLBACK) {
+                fprintf(f, "\"bytes\":%llu", (unsigned long long)ev->arg);
+            }
+        }
+        if (ev->selector != NULL) {
+            fputs(ev->kind == TRACE_CALLBACK ? "\"selector\":" : ",\"selector\":", f);
+            write_json_string(f, ev->selector);
+        }
+        fputs("}}", f);
+    }
+    /* tell how many events were dropped */
+    fprintf(f, "\n],\"otherData\":{\"dropped_events\":%llu}}\n",
+            (unsigned long long)(trace->len - count));
+
+    if (fclose(f) != 0) {
+        return luaL_fileresult(L, 0, path);
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+static const luaL_Reg rewriter_methods[] = {
     { "write", rewriter_write },
     { "close", rewriter_end }, // end is a keyword in Lua
+    { "events", rewriter_events },
+    { "reset", rewriter_reset },
+    { "stats", rewriter_stats },
+    { "timings", rewriter_timings },
+    { "latency", rewriter_latency },
+    { "latency_histogram", rewriter_latency_histogram },
+    { "dump_trace", rewriter_dump_trace },
     { NULL, NULL }
 };
 
@@ -852,6 +3395,7 @@ static luaL_Reg rewriter_methods[] = {
  */
 static int selector_new(lua_State *L) {
     size_t len;
+    module_metrics_t *metrics;
     const char *src = luaL_checklstring(L, 1, &len);
     lol_html_selector_t *selector = lol_html_selector_parse(src, len);
 
@@ -859,25 +3403,410 @@ static int selector_new(lua_State *L) {
         return push_last_error(L);
     }
 
-    lol_html_selector_t **lua_selector = lua_newuserdata(L, sizeof(lol_html_selector_t *));
-    *lua_selector = selector;
+    /* the source is kept for profiling purposes */
+    lua_selector_t *lua_selector = lua_newuserdata(L, sizeof(lua_selector_t) + len + 1);
+    lua_selector->selector = selector;
+    memcpy(lua_selector->source, src, len + 1);
     luaL_getmetatable(L, PREFIX "selector");
     lua_setmetatable(L, -2);
+    metrics = get_metrics(L);
+    metrics->selectors++;
+    metrics->selectors_total++;
+    native_sync(L, true);
 
     return 1;
 }
 
 static int selector_destroy(lua_State *L) {
-    lol_html_selector_t **lua_selector = luaL_checkudata(L, 1, PREFIX "selector");
-    lol_html_selector_free(*lua_selector);
+    lua_selector_t *lua_selector = luaL_checkudata(L, 1, PREFIX "selector");
+    lol_html_selector_free(lua_selector->selector);
+    get_metrics(L)->selectors--;
+    native_sync(L, false);
+    return 0;
+}
+
+/* builder templates */
+/* A template is the frozen structure of a builder: a list of entries, each one
+ * with an optional selector and named handler slots. It doesn't reference any
+ * Lua value, so it can be shared by all the Lua states of a process, each one
+ * binding its own functions to the slot names to get a regular builder.
+ * Selectors are parsed only once, and the template is reference counted: it
+ * is freed once the last Lua object using it is collected.
+ *
+ * Tokens are ids, never reused, and the live templates are kept in a
+ * process-wide list: an imported token is only used once found in that list,
+ * and the reference is taken under the same lock as the release.
+ */
+
+/* the slots of template entries are stored in the order of these fields */
+static const char *const document_handler_fields[] = {
+    "doctype_handler", "comment_handler", "text_handler", "doc_end_handler", NULL
+};
+static const char *const element_handler_fields[] = {
+    "element_handler", "comment_handler", "text_handler", "end_tag_handler", NULL
+};
+#define TEMPLATE_MAX_SLOTS 4
+
+typedef struct {
+    lol_html_selector_t *selector; /* NULL for document content handlers */
+    char *source;
+    char *slots[TEMPLATE_MAX_SLOTS];
+    bool events[TEMPLATE_MAX_SLOTS]; /* slots set to `true` */
+    /* handler options, forwarded as is to the builder methods by bind */
+    bool batch;
+    char *text_handler_mode;
+    char *capture_content;
+    lua_Integer max_text_length; /* -1 if not set */
+    lua_Integer max_capture_length;
+    char **attributes;
+    size_t nattributes;
+} template_entry_t;
+
+typedef struct builder_template_s builder_template_t;
+struct builder_template_s {
+    long refs; /* protected by templates_lock */
+    uint64_t id; /* token */
+    builder_template_t *next; /* in live_templates */
+    size_t len;
+    template_entry_t entries[];
+};
+
+static pthread_mutex_t templates_lock = PTHREAD_MUTEX_INITIALIZER;
+static builder_template_t *live_templates;
+static uint64_t next_template_id = 1;
+
+static void builder_template_release(builder_template_t *tpl) {
+    size_t i, j;
+    builder_template_t **it;
+    bool last;
+
+    pthread_mutex_lock(&templates_lock);
+    last = --tpl->refs == 0;
+    if (last) {
+        for (it = &live_templates; *it != tpl; it = &(*it)->next) {}
+        *it = tpl->next;
+    }
+    pthread_mutex_unlock(&templates_lock);
+    if (!last) {
+        return;
+    }
+
+    for (i = 0; i < tpl->len; i++) {
+        if (tpl->entries[i].selector != NULL) {
+            lol_html_selector_free(tpl->entries[i].selector);
+        }
+        free(tpl->entries[i].source);
+        for (j = 0; j < TEMPLATE_MAX_SLOTS; j++) {
+            free(tpl->entries[i].slots[j]);
+        }
+        free(tpl->entries[i].text_handler_mode);
+        free(tpl->entries[i].capture_content);
+        for (j = 0; j < tpl->entries[i].nattributes; j++) {
+            free(tpl->entries[i].attributes[j]);
+        }
+        free(tpl->entries[i].attributes);
+    }
+    free(tpl);
+}
+
+static builder_template_t** push_builder_template(lua_State *L, builder_template_t *tpl) {
+    module_metrics_t *metrics = get_metrics(L);
+    builder_template_t **ud = lua_newuserdata(L, sizeof(builder_template_t *));
+    *ud = tpl;
+    luaL_getmetatable(L, PREFIX "template");
+    lua_setmetatable(L, -2);
+    metrics->templates++;
+    metrics->templates_total++;
+    return ud;
+}
+
+/* copies the string option `field` of the entry at the top of the stack */
+static void template_string_option(lua_State *L, const char *field, char **dst) {
+    if (lua_getfield(L, -1, field) != LUA_TNIL) {
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1, field);
+        if ((*dst = copy_string(lua_tostring(L, -1))) == NULL) {
+            luaL_error(L, "not enough memory");
+        }
+    }
+    lua_pop(L, 1);
+}
+
+/* reads the integer option `field` of the entry at the top of the stack */
+static lua_Integer template_integer_option(lua_State *L, const char *field) {
+    lua_Integer value = -1;
+    if (lua_getfield(L, -1, field) != LUA_TNIL) {
+        int isnum;
+        value = lua_tointegerx(L, -1, &isnum);
+        luaL_argcheck(L, isnum && value >= 0, 1, field);
+    }
+    lua_pop(L, 1);
+    return value;
+}
+
+/* copies the `attributes` option of the entry at the top of the stack */
+static void template_attributes_option(lua_State *L, template_entry_t *entry) {
+    size_t i, n;
+    if (lua_getfield(L, -1, "attributes") != LUA_TNIL) {
+        luaL_argcheck(L, lua_istable(L, -1), 1, "attributes");
+        n = lua_rawlen(L, -1);
+        if ((entry->attributes = calloc(n, sizeof(char *))) == NULL && n > 0) {
+            luaL_error(L, "not enough memory");
+        }
+        entry->nattributes = n;
+        for (i = 0; i < n; i++) {
+            luaL_argcheck(L, lua_rawgeti(L, -1, i + 1) == LUA_TSTRING, 1, "attribute names must be strings");
+            if ((entry->attributes[i] = copy_string(lua_tostring(L, -1))) == NULL) {
+                luaL_error(L, "not enough memory");
+            }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+}
+
+static int builder_template_new(lua_State *L) {
+    size_t i, j, len;
+    builder_template_t *tpl;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    len = lua_rawlen(L, 1);
+
+    tpl = calloc(1, sizeof(builder_template_t) + len * sizeof(template_entry_t));
+    if (tpl == NULL) {
+        return luaL_error(L, "not enough memory");
+    }
+    tpl->refs = 1;
+    tpl->len = len;
+    for (i = 0; i < len; i++) {
+        tpl->entries[i].max_text_length = tpl->entries[i].max_capture_length = -1;
+    }
+    pthread_mutex_lock(&templates_lock);
+    tpl->id = next_template_id++;
+    tpl->next = live_templates;
+    live_templates = tpl;
+    pthread_mutex_unlock(&templates_lock);
+    /* box it right away so it is freed by the GC if an error is raised */
+    push_builder_template(L, tpl);                         /* ud */
+
+    for (i = 0; i < len; i++) {
+        template_entry_t *entry = &tpl->entries[i];
+        const char *const *fields = document_handler_fields;
+
+        lua_rawgeti(L, 1, i + 1);                          /* ud, entry */
+        luaL_argcheck(L, lua_istable(L, -1), 1, "template entries must be tables");
+        if (lua_getfield(L, -1, "selector") != LUA_TNIL) { /* ud, entry, sel */
+            size_t sel_len;
+            const char *sel;
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1, "selectors must be strings");
+            sel = lua_tolstring(L, -1, &sel_len);
+            entry->selector = lol_html_selector_parse(sel, sel_len);
+            if (entry->selector == NULL) {
+                return push_last_error(L);
+            }
+            if ((entry->source = copy_string(sel)) == NULL) {
+                return luaL_error(L, "not enough memory");
+            }
+            fields = element_handler_fields;
+        }
+        lua_pop(L, 1);                                     /* ud, entry */
+
+        for (j = 0; fields[j] != NULL; j++) {
+            switch (lua_getfield(L, -1, fields[j])) {      /* ud, entry, slot */
+            case LUA_TNIL: break;
+            case LUA_TSTRING:
+                if ((entry->slots[j] = copy_string(lua_tostring(L, -1))) == NULL) {
+                    return luaL_error(L, "not enough memory");
+                }
+                break;
+            case LUA_TBOOLEAN:
+                entry->events[j] = lua_toboolean(L, -1);
+                break;
+            default:
+                luaL_argerror(L, 1, "slots must be names or booleans");
+            }
+            lua_pop(L, 1);                                 /* ud, entry */
+        }
+
+        /* the options are checked by the builder methods when bound */
+        lua_getfield(L, -1, "batch");                      /* ud, entry, batch */
+        entry->batch = lua_toboolean(L, -1);
+        lua_pop(L, 1);                                     /* ud, entry */
+        template_string_option(L, "text_handler_mode", &entry->text_handler_mode);
+        entry->max_text_length = template_integer_option(L, "max_text_length");
+        if (entry->selector != NULL) {
+            template_string_option(L, "capture_content", &entry->capture_content);
+            entry->max_capture_length = template_integer_option(L, "max_capture_length");
+            template_attributes_option(L, entry);
+        }
+        lua_pop(L, 1);                                     /* ud */
+    }
+
+    return 1;
+}
+
+static int builder_template_import(lua_State *L) {
+    builder_template_t *tpl;
+    uint64_t token;
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+    token = (uintptr_t)lua_touserdata(L, 1);
+    /* the token is compared to the ids of the live templates */
+    pthread_mutex_lock(&templates_lock);
+    for (tpl = live_templates; tpl != NULL && tpl->id != token; tpl = tpl->next) {}
+    if (tpl != NULL) {
+        tpl->refs++;
+    }
+    pthread_mutex_unlock(&templates_lock);
+    luaL_argcheck(L, tpl != NULL, 1, "not a live template token");
+    push_builder_template(L, tpl);
+    return 1;
+}
+
+static int builder_template_destroy(lua_State *L) {
+    builder_template_t **tpl = luaL_checkudata(L, 1, PREFIX "template");
+    if (*tpl != NULL) {
+        builder_template_release(*tpl);
+        *tpl = NULL;
+        get_metrics(L)->templates--;
+        native_sync(L, false);
+    }
     return 0;
 }
 
+static int builder_template_token(lua_State *L) {
+    builder_template_t **tpl = luaL_checkudata(L, 1, PREFIX "template");
+    lua_pushlightuserdata(L, (void *)(uintptr_t)(*tpl)->id);
+    return 1;
+}
+
+/* creates a new builder with the given functions bound to the slots */
+static int builder_template_bind(lua_State *L) {
+    size_t i, j;
+    builder_template_t **tpl = luaL_checkudata(L, 1, PREFIX "template");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    rewriter_builder_new(L);                              /* tpl, funcs, builder */
+
+    /* anchor the template to the builder to keep the selectors alive */
+    lua_getuservalue(L, 3);                               /* tpl, funcs, builder, uv */
+    lua_pushvalue(L, 1);
+    lua_setfield(L, -2, "template");
+    lua_pop(L, 1);                                        /* tpl, funcs, builder */
+
+    for (i = 0; i < (*tpl)->len; i++) {
+        template_entry_t *entry = &(*tpl)->entries[i];
+        const char *const *fields = (entry->selector == NULL) ?
+            document_handler_fields : element_handler_fields;
+
+        /* build a handlers table as it would be given to the builder methods */
+        lua_createtable(L, 0, TEMPLATE_MAX_SLOTS + 6);    /* tpl, funcs, builder, cbs */
+        for (j = 0; fields[j] != NULL; j++) {
+            if (entry->slots[j] != NULL) {
+                lua_getfield(L, 2, entry->slots[j]);
+                lua_setfield(L, 4, fields[j]);
+            } else if (entry->events[j]) {
+                lua_pushboolean(L, 1);
+                lua_setfield(L, 4, fields[j]);
+            }
+        }
+        if (entry->batch) {
+            lua_pushboolean(L, 1);
+            lua_setfield(L, 4, "batch");
+        }
+        if (entry->text_handler_mode != NULL) {
+            lua_pushstring(L, entry->text_handler_mode);
+            lua_setfield(L, 4, "text_handler_mode");
+        }
+        if (entry->max_text_length >= 0) {
+            lua_pushinteger(L, entry->max_text_length);
+            lua_setfield(L, 4, "max_text_length");
+        }
+        if (entry->capture_content != NULL) {
+            lua_pushstring(L, entry->capture_content);
+            lua_setfield(L, 4, "capture_content");
+        }
+        if (entry->max_capture_length >= 0) {
+            lua_pushinteger(L, entry->max_capture_length);
+            lua_setfield(L, 4, "max_capture_length");
+        }
+        if (entry->nattributes > 0) {
+            lua_createtable(L, entry->nattributes, 0);
+            for (j = 0; j < entry->nattributes; j++) {
+                lua_pushstring(L, entry->attributes[j]);
+                lua_rawseti(L, -2, j + 1);
+            }
+            lua_setfield(L, 4, "attributes");
+        }
+
+        if (entry->selector == NULL) {
+            add_document_content_handlers(L, 3, 4);
+        } else if (add_element_content_handlers(L, 3, 4, entry->selector, entry->source) != 0) {
+            return push_last_error(L);
+        }
+        lua_pop(L, 1);                                    /* tpl, funcs, builder */
+    }
+
+    return 1;
+}
+
+static const luaL_Reg builder_template_methods[] = {
+    { "token", builder_template_token },
+    { "bind", builder_template_bind },
+    { NULL, NULL }
+};
+
 /* top level module */
-static luaL_Reg module_functions[] = {
+static int module_metrics(lua_State *L) {
+    uint64_t slots = 0;
+    module_metrics_t *metrics = get_metrics(L);
+
+    /* fill the table given by the caller to avoid allocations */
+    if (lua_isnoneornil(L, 1)) {
+        lua_settop(L, 0);
+        lua_createtable(L, 0, 12);
+    } else {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_settop(L, 1);
+    }
+
+    set_counter(L, "builders", metrics->builders);
+    set_counter(L, "rewriters", metrics->rewriters);
+    set_counter(L, "selectors", metrics->selectors);
+    set_counter(L, "templates", metrics->templates);
+    set_counter(L, "handlers", metrics->handlers);
+    set_counter(L, "builders_total", metrics->builders_total);
+    set_counter(L, "rewriters_total", metrics->rewriters_total);
+    set_counter(L, "selectors_total", metrics->selectors_total);
+    set_counter(L, "templates_total", metrics->templates_total);
+    set_counter(L, "handlers_total", metrics->handlers_total);
+    set_counter(L, "documents_total", metrics->documents_total);
+    /* the registry is weak and has holes, so its length is meaningless: the
+     * objects are counted, skipping the luaL_ref free list (integers) */
+    lua_getfield(L, LUA_REGISTRYINDEX, LOL_REGISTRY);
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        slots += lua_type(L, -1) == LUA_TUSERDATA;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    set_counter(L, "registry_slots", slots);
+#ifdef LOLHTML_ALLOC_HOOK
+    native_sync(L, false);
+    lua_pushinteger(L, (lua_Integer)metrics->native_bytes);
+    lua_setfield(L, -2, "native_bytes");
+    lua_pushinteger(L, (lua_Integer)atomic_load(&native_bytes_process));
+    lua_setfield(L, -2, "native_bytes_process");
+#endif
+    return 1;
+}
+
+static const luaL_Reg module_functions[] = {
     { "new_rewriter_builder", rewriter_builder_new },
     { "new_rewriter", rewriter_new },
     { "new_selector", selector_new },
+    { "new_builder_template", builder_template_new },
+    { "import_builder_template", builder_template_import },
+    { "metrics", module_metrics },
     { NULL, NULL }
 };
 
@@ -894,6 +3823,10 @@ int luaopen_lolhtml(lua_State *L) {
     lua_setmetatable(L, -2);       /* reg */
     lua_setfield(L, LUA_REGISTRYINDEX, LOL_REGISTRY);
 
+    /* metrics: the userdata memory is released after all the finalizers ran */
+    memset(lua_newuserdata(L, sizeof(module_metrics_t)), 0, sizeof(module_metrics_t));
+    lua_setfield(L, LUA_REGISTRYINDEX, METRICS_KEY);
+
     /* register types */
     luaL_newmetatable(L, PREFIX "builder");
     lua_newtable(L);
@@ -916,6 +3849,14 @@ int luaopen_lolhtml(lua_State *L) {
     lua_setfield(L, -2, "__gc");
     lua_pop(L, 1);
 
+    luaL_newmetatable(L, PREFIX "template");
+    lua_newtable(L);
+    luaL_setfuncs(L, builder_template_methods, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, builder_template_destroy);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     luaL_newmetatable(L, PREFIX "doctype");
     lua_newtable(L);
     luaL_setfuncs(L, doctype_methods, 0);
@@ -934,6 +3875,16 @@ int luaopen_lolhtml(lua_State *L) {
     lua_setfield(L, -2, "__index");
     lua_pop(L, 1);
 
+    luaL_newmetatable(L, PREFIX "text_view");
+    lua_newtable(L);
+    luaL_setfuncs(L, text_view_methods, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, text_view_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, text_view_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
+
     luaL_newmetatable(L, PREFIX "doc_end");
     lua_newtable(L);
     luaL_setfuncs(L, doc_end_methods, 0);
@@ -946,6 +3897,12 @@ int luaopen_lolhtml(lua_State *L) {
     lua_setfield(L, -2, "__index");
     lua_pop(L, 1);
 
+    luaL_newmetatable(L, PREFIX "end_tag");
+    lua_newtable(L);
+    luaL_setfuncs(L, end_tag_methods, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
     luaL_newmetatable(L, PREFIX "attribute_iterator");
     lua_pushcfunction(L, attribute_iterator_destroy);
     lua_setfield(L, -2, "__gc");
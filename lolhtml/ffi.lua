@@ -0,0 +1,594 @@
+--- LuaJIT FFI binding of lol-html.
+--
+-- This is an alternative to the C module for LuaJIT (e.g. OpenResty): all the
+-- calls to lol-html are made through the FFI, so the handlers and the
+-- accessors they use can be JIT-compiled, whereas the C module calls the
+-- handlers with `lua_pcall` and exposes the accessors as `lua_CFunction`s,
+-- which both abort traces.
+--
+-- The API is the same as the C module for the core objects (selectors,
+-- builders, rewriters and the objects given to the handlers), with these
+-- differences:
+--
+-- * handler parameters are raw pointers: they must not be used once the
+--   handler returned (the C module raises an error in that case, here it is
+--   undefined behaviour)
+-- * TextChunk has a zero-copy `get_text_ptr()` returning a `const char *` and
+--   a length, only valid during the handler
+-- * the observability features of the C module (stats, timings, tracing, ...)
+--   are not available
+--
+-- The lol-html symbols are taken from the C module shared object, which embeds
+-- the whole lol-html library, so it must be in `package.cpath` (it doesn't
+-- need to be loaded with `require` though).
+
+local ffi = require "ffi"
+local jit = require "jit"
+
+local C = ffi.C
+local cast, new, gc, ffi_string = ffi.cast, ffi.new, ffi.gc, ffi.string
+local type, error, pcall, tonumber = type, error, pcall, tonumber
+local setmetatable = setmetatable
+
+ffi.cdef [[
+typedef struct lol_html_HtmlRewriterBuilder lol_html_rewriter_builder_t;
+typedef struct lol_html_HtmlRewriter lol_html_rewriter_t;
+typedef struct lol_html_Doctype lol_html_doctype_t;
+typedef struct lol_html_DocumentEnd lol_html_doc_end_t;
+typedef struct lol_html_Comment lol_html_comment_t;
+typedef struct lol_html_TextChunk lol_html_text_chunk_t;
+typedef struct lol_html_Element lol_html_element_t;
+typedef struct lol_html_AttributesIterator lol_html_attributes_iterator_t;
+typedef struct lol_html_Attribute lol_html_attribute_t;
+typedef struct lol_html_Selector lol_html_selector_t;
+
+typedef struct {
+    const char *data;
+    size_t len;
+} lol_html_str_t;
+
+typedef struct {
+    const char *data;
+    size_t len;
+} lol_html_text_chunk_content_t;
+
+typedef struct {
+    size_t preallocated_parsing_buffer_size;
+    size_t max_allowed_memory_usage;
+} lol_html_memory_settings_t;
+
+typedef enum {
+    LOL_HTML_CONTINUE,
+    LOL_HTML_STOP
+} lol_html_rewriter_directive_t;
+
+typedef lol_html_rewriter_directive_t (*lol_html_doctype_handler_t)(lol_html_doctype_t *doctype, void *user_data);
+typedef lol_html_rewriter_directive_t (*lol_html_comment_handler_t)(lol_html_comment_t *comment, void *user_data);
+typedef lol_html_rewriter_directive_t (*lol_html_text_handler_handler_t)(lol_html_text_chunk_t *chunk, void *user_data);
+typedef lol_html_rewriter_directive_t (*lol_html_element_handler_t)(lol_html_element_t *element, void *user_data);
+typedef lol_html_rewriter_directive_t (*lol_html_doc_end_handler_t)(lol_html_doc_end_t *doc_end, void *user_data);
+typedef void (*lol_html_output_sink_t)(const char *chunk, size_t chunk_len, void *user_data);
+
+void free(void *ptr);
+
+void lol_html_str_free(lol_html_str_t str);
+lol_html_str_t *lol_html_take_last_error();
+
+lol_html_rewriter_builder_t *lol_html_rewriter_builder_new();
+void lol_html_rewriter_builder_add_document_content_handlers(
+    lol_html_rewriter_builder_t *builder,
+    lol_html_doctype_handler_t doctype_handler, void *doctype_handler_user_data,
+    lol_html_comment_handler_t comment_handler, void *comment_handler_user_data,
+    lol_html_text_handler_handler_t text_handler, void *text_handler_user_data,
+    lol_html_doc_end_handler_t doc_end_handler, void *doc_end_user_data);
+int lol_html_rewriter_builder_add_element_content_handlers(
+    lol_html_rewriter_builder_t *builder, const lol_html_selector_t *selector,
+    lol_html_element_handler_t element_handler, void *element_handler_user_data,
+    lol_html_comment_handler_t comment_handler, void *comment_handler_user_data,
+    lol_html_text_handler_handler_t text_handler, void *text_handler_user_data);
+void lol_html_rewriter_builder_free(lol_html_rewriter_builder_t *builder);
+
+lol_html_selector_t *lol_html_selector_parse(const char *selector, size_t selector_len);
+void lol_html_selector_free(lol_html_selector_t *selector);
+
+lol_html_rewriter_t *lol_html_rewriter_build(
+    lol_html_rewriter_builder_t *builder, const char *encoding, size_t encoding_len,
+    lol_html_memory_settings_t memory_settings, lol_html_output_sink_t output_sink,
+    void *output_sink_user_data, bool strict);
+int lol_html_rewriter_write(lol_html_rewriter_t *rewriter, const char *chunk, size_t chunk_len);
+int lol_html_rewriter_end(lol_html_rewriter_t *rewriter);
+void lol_html_rewriter_free(lol_html_rewriter_t *rewriter);
+
+lol_html_str_t *lol_html_doctype_name_get(const lol_html_doctype_t *doctype);
+lol_html_str_t *lol_html_doctype_public_id_get(const lol_html_doctype_t *doctype);
+lol_html_str_t *lol_html_doctype_system_id_get(const lol_html_doctype_t *doctype);
+
+lol_html_str_t lol_html_comment_text_get(const lol_html_comment_t *comment);
+int lol_html_comment_text_set(lol_html_comment_t *comment, const char *text, size_t text_len);
+int lol_html_comment_before(lol_html_comment_t *comment, const char *content, size_t content_len, bool is_html);
+int lol_html_comment_after(lol_html_comment_t *comment, const char *content, size_t content_len, bool is_html);
+int lol_html_comment_replace(lol_html_comment_t *comment, const char *content, size_t content_len, bool is_html);
+void lol_html_comment_remove(lol_html_comment_t *comment);
+bool lol_html_comment_is_removed(const lol_html_comment_t *comment);
+
+lol_html_text_chunk_content_t lol_html_text_chunk_content_get(const lol_html_text_chunk_t *chunk);
+bool lol_html_text_chunk_is_last_in_text_node(const lol_html_text_chunk_t *chunk);
+int lol_html_text_chunk_before(lol_html_text_chunk_t *chunk, const char *content, size_t content_len, bool is_html);
+int lol_html_text_chunk_after(lol_html_text_chunk_t *chunk, const char *content, size_t content_len, bool is_html);
+int lol_html_text_chunk_replace(lol_html_text_chunk_t *chunk, const char *content, size_t content_len, bool is_html);
+void lol_html_text_chunk_remove(lol_html_text_chunk_t *chunk);
+bool lol_html_text_chunk_is_removed(const lol_html_text_chunk_t *chunk);
+
+int lol_html_doc_end_append(lol_html_doc_end_t *doc_end, const char *content, size_t content_len, bool is_html);
+
+lol_html_str_t lol_html_element_tag_name_get(const lol_html_element_t *element);
+const char *lol_html_element_namespace_uri_get(const lol_html_element_t *element);
+lol_html_str_t *lol_html_element_get_attribute(const lol_html_element_t *element, const char *name, size_t name_len);
+int lol_html_element_has_attribute(const lol_html_element_t *element, const char *name, size_t name_len);
+int lol_html_element_set_attribute(lol_html_element_t *element, const char *name, size_t name_len,
+                                   const char *value, size_t value_len);
+int lol_html_element_remove_attribute(lol_html_element_t *element, const char *name, size_t name_len);
+lol_html_attributes_iterator_t *lol_html_attributes_iterator_get(const lol_html_element_t *element);
+const lol_html_attribute_t *lol_html_attributes_iterator_next(lol_html_attributes_iterator_t *iterator);
+void lol_html_attributes_iterator_free(lol_html_attributes_iterator_t *iterator);
+lol_html_str_t lol_html_attribute_name_get(const lol_html_attribute_t *attribute);
+lol_html_str_t lol_html_attribute_value_get(const lol_html_attribute_t *attribute);
+int lol_html_element_before(lol_html_element_t *element, const char *content, size_t content_len, bool is_html);
+int lol_html_element_after(lol_html_element_t *element, const char *content, size_t content_len, bool is_html);
+int lol_html_element_prepend(lol_html_element_t *element, const char *content, size_t content_len, bool is_html);
+int lol_html_element_append(lol_html_element_t *element, const char *content, size_t content_len, bool is_html);
+int lol_html_element_set_inner_content(lol_html_element_t *element, const char *content, size_t content_len, bool is_html);
+int lol_html_element_replace(lol_html_element_t *element, const char *content, size_t content_len, bool is_html);
+void lol_html_element_remove(lol_html_element_t *element);
+void lol_html_element_remove_and_keep_content(lol_html_element_t *element);
+bool lol_html_element_is_removed(const lol_html_element_t *element);
+]]
+
+local lib = ffi.load(assert(package.searchpath("lolhtml", package.cpath),
+                            "lolhtml shared object not found in package.cpath"))
+
+local CONTINUE, STOP = lib.LOL_HTML_CONTINUE, lib.LOL_HTML_STOP
+local SIZE_MAX = cast("size_t", -1)
+
+local _M = {
+  CONTINUE = tonumber(CONTINUE),
+  STOP = tonumber(STOP),
+  lib = lib,
+}
+
+-- same as push_last_error in the C module: must be called right after the
+-- failing call, on the same thread
+local function last_error()
+  local err = lib.lol_html_take_last_error()
+  if err == nil then
+    return nil, "unknown error"
+  end
+  local msg = ffi_string(err.data, err.len)
+  lib.lol_html_str_free(err[0])
+  C.free(err)
+  return nil, msg
+end
+
+local function str_maybe(s)
+  if s == nil then return nil end
+  local value = ffi_string(s.data, s.len)
+  lib.lol_html_str_free(s[0])
+  C.free(s)
+  return value
+end
+
+local function str(s)
+  local value = ffi_string(s.data, s.len)
+  lib.lol_html_str_free(s)
+  return value
+end
+
+local function self_or_err(self, rc)
+  if rc ~= 0 then
+    return last_error()
+  end
+  return self
+end
+
+-- content methods, shared by all types that can insert content
+local function content_method(fn)
+  return function(self, content, is_html)
+    return self_or_err(self, fn(self, content, #content, not not is_html))
+  end
+end
+
+-- Handler parameters: methods are attached to the lol-html types directly, so
+-- no object is allocated for each call.
+ffi.metatype("struct lol_html_Doctype", { __index = {
+  get_name = function(self) return str_maybe(lib.lol_html_doctype_name_get(self)) end,
+  get_id = function(self) return str_maybe(lib.lol_html_doctype_public_id_get(self)) end,
+  get_system_id = function(self) return str_maybe(lib.lol_html_doctype_system_id_get(self)) end,
+}})
+
+ffi.metatype("struct lol_html_Comment", { __index = {
+  get_text = function(self) return str(lib.lol_html_comment_text_get(self)) end,
+  set_text = function(self, text)
+    return self_or_err(self, lib.lol_html_comment_text_set(self, text, #text))
+  end,
+  before = content_method(lib.lol_html_comment_before),
+  after = content_method(lib.lol_html_comment_after),
+  replace = content_method(lib.lol_html_comment_replace),
+  remove = function(self) lib.lol_html_comment_remove(self) return self end,
+  is_removed = function(self) return lib.lol_html_comment_is_removed(self) end,
+}})
+
+ffi.metatype("struct lol_html_TextChunk", { __index = {
+  get_text = function(self)
+    local content = lib.lol_html_text_chunk_content_get(self)
+    return ffi_string(content.data, content.len)
+  end,
+  get_text_ptr = function(self)
+    local content = lib.lol_html_text_chunk_content_get(self)
+    return content.data, tonumber(content.len)
+  end,
+  is_last_in_text_node = function(self) return lib.lol_html_text_chunk_is_last_in_text_node(self) end,
+  before = content_method(lib.lol_html_text_chunk_before),
+  after = content_method(lib.lol_html_text_chunk_after),
+  replace = content_method(lib.lol_html_text_chunk_replace),
+  remove = function(self) lib.lol_html_text_chunk_remove(self) return self end,
+  is_removed = function(self) return lib.lol_html_text_chunk_is_removed(self) end,
+}})
+
+ffi.metatype("struct lol_html_DocumentEnd", { __index = {
+  append = content_method(lib.lol_html_doc_end_append),
+}})
+
+local function attributes_next(state)
+  local it = state.it
+  if it == nil then return nil end
+  local attr = lib.lol_html_attributes_iterator_next(it)
+  if attr == nil then
+    -- end of the attributes: eagerly free the iterator
+    state.it = nil
+    lib.lol_html_attributes_iterator_free(gc(it, nil))
+    return nil
+  end
+  return str(lib.lol_html_attribute_name_get(attr)), str(lib.lol_html_attribute_value_get(attr))
+end
+
+ffi.metatype("struct lol_html_Element", { __index = {
+  get_tag_name = function(self) return str(lib.lol_html_element_tag_name_get(self)) end,
+  get_namespace_uri = function(self) return ffi_string(lib.lol_html_element_namespace_uri_get(self)) end,
+  get_attribute = function(self, name)
+    return str_maybe(lib.lol_html_element_get_attribute(self, name, #name))
+  end,
+  has_attribute = function(self, name)
+    local rc = lib.lol_html_element_has_attribute(self, name, #name)
+    if rc < 0 then return last_error() end
+    return rc == 1
+  end,
+  set_attribute = function(self, name, value)
+    return self_or_err(self, lib.lol_html_element_set_attribute(self, name, #name, value, #value))
+  end,
+  remove_attribute = function(self, name)
+    return self_or_err(self, lib.lol_html_element_remove_attribute(self, name, #name))
+  end,
+  attributes = function(self)
+    -- the iterator is freed by the GC if the loop is left early
+    local it = gc(lib.lol_html_attributes_iterator_get(self), lib.lol_html_attributes_iterator_free)
+    return attributes_next, { it = it }, nil
+  end,
+  snapshot = function(self, t)
+    t = t or {}
+    t.tag = str(lib.lol_html_element_tag_name_get(self))
+    t.namespace = ffi_string(lib.lol_html_element_namespace_uri_get(self))
+    local attrs = t.attributes
+    if type(attrs) == "table" then
+      for k in pairs(attrs) do attrs[k] = nil end
+    else
+      attrs = {}
+      t.attributes = attrs
+    end
+    local it = lib.lol_html_attributes_iterator_get(self)
+    local attr = lib.lol_html_attributes_iterator_next(it)
+    while attr ~= nil do
+      attrs[str(lib.lol_html_attribute_name_get(attr))] = str(lib.lol_html_attribute_value_get(attr))
+      attr = lib.lol_html_attributes_iterator_next(it)
+    end
+    lib.lol_html_attributes_iterator_free(it)
+    return t
+  end,
+  get_attributes = function(self, names, out)
+    out = out or {}
+    for i=1, #names do
+      local name = names[i]
+      out[name] = str_maybe(lib.lol_html_element_get_attribute(self, name, #name))
+    end
+    return out
+  end,
+  before = content_method(lib.lol_html_element_before),
+  after = content_method(lib.lol_html_element_after),
+  prepend = content_method(lib.lol_html_element_prepend),
+  append = content_method(lib.lol_html_element_append),
+  set_inner_content = content_method(lib.lol_html_element_set_inner_content),
+  replace = content_method(lib.lol_html_element_replace),
+  remove = function(self) lib.lol_html_element_remove(self) return self end,
+  remove_and_keep_content = function(self) lib.lol_html_element_remove_and_keep_content(self) return self end,
+  is_removed = function(self) return lib.lol_html_element_is_removed(self) end,
+}})
+
+-- Callbacks: the number of FFI callbacks is limited and creating them is
+-- expensive, so there is a single callback per handler type, dispatching to
+-- the Lua handlers with the id passed as user data.
+local handlers = {} -- id => { fn, state }, state is shared with the builder
+local rewriters = setmetatable({}, { __mode = "v" }) -- id => rewriter
+local next_id = 0
+
+local function new_id()
+  next_id = next_id + 1
+  return next_id
+end
+
+local function dispatch(param, user_data)
+  local handler = handlers[tonumber(cast("intptr_t", user_data))]
+  local rewriter = handler[2].active
+  local ok, res
+  if rewriter.has_context then
+    ok, res = pcall(handler[1], param, rewriter.context)
+  else
+    ok, res = pcall(handler[1], param)
+  end
+  if not ok then
+    -- errors can't be raised through lol-html, keep it for `write`
+    rewriter.err = res
+    return STOP
+  end
+  if res == nil or res == _M.CONTINUE then
+    return CONTINUE
+  elseif res == _M.STOP then
+    return STOP
+  end
+  rewriter.err = "invalid content handler return"
+  return STOP
+end
+
+local doctype_cb = cast("lol_html_doctype_handler_t", dispatch)
+local comment_cb = cast("lol_html_comment_handler_t", dispatch)
+local text_cb = cast("lol_html_text_handler_handler_t", dispatch)
+local doc_end_cb = cast("lol_html_doc_end_handler_t", dispatch)
+local element_cb = cast("lol_html_element_handler_t", dispatch)
+
+local sink_cb = cast("lol_html_output_sink_t", function(chunk, len, user_data)
+  local rewriter = rewriters[tonumber(cast("intptr_t", user_data))]
+  if rewriter.broken then return end
+  local ok, err
+  if rewriter.has_context then
+    ok, err = pcall(rewriter.sink, ffi_string(chunk, len), rewriter.context)
+  else
+    ok, err = pcall(rewriter.sink, ffi_string(chunk, len))
+  end
+  if not ok then
+    -- the Lua sink will not be called again for this document
+    rewriter.broken = true
+    rewriter.err = err
+  end
+end)
+
+-- Selectors
+local selector_mt = { __index = {} }
+
+function _M.new_selector(source)
+  local ptr = lib.lol_html_selector_parse(source, #source)
+  if ptr == nil then
+    return last_error()
+  end
+  return setmetatable({ ptr = gc(ptr, lib.lol_html_selector_free), source = source }, selector_mt)
+end
+
+-- Builders
+local builder_methods = {}
+local builder_mt = { __index = builder_methods }
+
+-- handler options of the C module that are not implemented here: they are
+-- rejected rather than silently ignored
+local unsupported_options = {
+  "batch", "attributes", "text_handler_mode", "max_text_length",
+  "capture_content", "max_capture_length", "end_tag_handler",
+}
+
+local function check_options(callbacks)
+  for i = 1, #unsupported_options do
+    local name = unsupported_options[i]
+    if callbacks[name] ~= nil then
+      error(name .. " is unsupported in the FFI module", 3)
+    end
+  end
+end
+
+-- registers the handler in the `field` of `callbacks`, returns the callback
+-- and the user data to give to lol-html
+local function create_handler(self, callbacks, field, cb)
+  local fn = callbacks[field]
+  if fn == nil then
+    return nil, nil
+  elseif fn == true then
+    error("events are unsupported in the FFI module", 3)
+  end
+  local id = new_id()
+  handlers[id] = { fn, self.state }
+  self.ids[#self.ids + 1] = id
+  return cb, cast("void *", id)
+end
+
+function builder_methods:add_document_content_handlers(callbacks)
+  check_options(callbacks)
+  local doctype, doctype_ud = create_handler(self, callbacks, "doctype_handler", doctype_cb)
+  local comment, comment_ud = create_handler(self, callbacks, "comment_handler", comment_cb)
+  local text, text_ud = create_handler(self, callbacks, "text_handler", text_cb)
+  local doc_end, doc_end_ud = create_handler(self, callbacks, "doc_end_handler", doc_end_cb)
+  lib.lol_html_rewriter_builder_add_document_content_handlers(self.ptr,
+    doctype, doctype_ud, comment, comment_ud, text, text_ud, doc_end, doc_end_ud)
+  return self
+end
+
+function builder_methods:add_element_content_handlers(callbacks)
+  local selector = callbacks.selector
+  if getmetatable(selector) ~= selector_mt then
+    error("bad argument #1 to 'add_element_content_handlers' (selector expected)", 2)
+  end
+  check_options(callbacks)
+  -- anchor the selector to the builder
+  self.selectors[#self.selectors + 1] = selector
+  local element, element_ud = create_handler(self, callbacks, "element_handler", element_cb)
+  local comment, comment_ud = create_handler(self, callbacks, "comment_handler", comment_cb)
+  local text, text_ud = create_handler(self, callbacks, "text_handler", text_cb)
+  return self_or_err(self, lib.lol_html_rewriter_builder_add_element_content_handlers(self.ptr,
+    selector.ptr, element, element_ud, comment, comment_ud, text, text_ud))
+end
+
+function _M.new_rewriter_builder()
+  local ids = {}
+  local ptr = gc(lib.lol_html_rewriter_builder_new(), function(ptr)
+    -- must not reference the builder table, only the handler ids
+    for i = 1, #ids do
+      handlers[ids[i]] = nil
+    end
+    lib.lol_html_rewriter_builder_free(ptr)
+  end)
+  -- `state.active` is the rewriter currently feeding the handlers
+  return setmetatable({ ptr = ptr, ids = ids, selectors = {}, state = {} }, builder_mt)
+end
+
+-- Rewriters
+local rewriter_methods = {}
+local rewriter_mt = { __index = rewriter_methods }
+
+local function check_sink(sink)
+  if type(sink) ~= "function" then
+    local mt = getmetatable(sink)
+    if not (mt and mt.__call) then
+      error("bad argument #1 (field \"sink\" cannot be called)", 3)
+    end
+  end
+end
+
+local function build(self)
+  self.broken = false
+  self.err = nil
+  local ptr = lib.lol_html_rewriter_build(self.builder.ptr, self.encoding, #self.encoding,
+    self.memory_settings, sink_cb, cast("void *", self.id), self.strict)
+  if ptr == nil then
+    return false
+  end
+  self.ptr = gc(ptr, lib.lol_html_rewriter_free)
+  return true
+end
+
+local function free(self)
+  lib.lol_html_rewriter_free(gc(self.ptr, nil))
+  self.ptr = nil
+end
+
+function _M.new_rewriter(options)
+  local builder = options.builder
+  if getmetatable(builder) ~= builder_mt then
+    error("bad argument #1 to 'new_rewriter' (builder expected)", 2)
+  end
+  if options.sink == nil then
+    error("rewriters without sink are unsupported in the FFI module", 2)
+  end
+  check_sink(options.sink)
+  local self = setmetatable({
+    id = new_id(),
+    builder = builder,
+    sink = options.sink,
+    context = options.context,
+    has_context = options.context ~= nil,
+    encoding = options.encoding or "utf-8",
+    memory_settings = new("lol_html_memory_settings_t", {
+      options.preallocated_parsing_buffer_size or 1024,
+      options.max_allowed_memory_usage or SIZE_MAX,
+    }),
+    strict = not not options.strict,
+  }, rewriter_mt)
+  if not build(self) then
+    return last_error()
+  end
+  rewriters[self.id] = self
+  return self
+end
+
+-- same logic as return_self_or_stack_error in the C module
+local function self_or_rewriter_err(self, rc)
+  local err = self.err
+  if rc == 0 and err == nil then
+    return self
+  end
+  local msg
+  if err ~= nil then
+    msg = err
+  else
+    -- lol-html error: take it before calling lol-html again
+    local _
+    _, msg = last_error()
+  end
+  if self.ptr ~= nil then
+    free(self)
+  end
+  return nil, msg
+end
+
+local function call(self, fn, ...)
+  local state = self.builder.state
+  local prev_active = state.active
+  state.active = self
+  local rc = fn(self.ptr, ...)
+  state.active = prev_active
+  return rc
+end
+
+function rewriter_methods:write(chunk)
+  if self.ptr == nil then
+    return nil, "broken rewriter"
+  end
+  return self_or_rewriter_err(self, call(self, lib.lol_html_rewriter_write, chunk, #chunk))
+end
+
+function rewriter_methods:close()
+  if self.ptr == nil then
+    return nil, "broken rewriter"
+  end
+  local rc = call(self, lib.lol_html_rewriter_end)
+  -- destroy it anyway, otherwise calling the rewriter again will abort
+  if rc == 0 then
+    free(self)
+  end
+  return self_or_rewriter_err(self, rc)
+end
+
+-- lol-html calls back into Lua from these: a C function called from a
+-- compiled trace must not re-enter the VM, so keep them interpreted
+jit.off(call)
+jit.off(rewriter_methods.write)
+jit.off(rewriter_methods.close)
+
+function rewriter_methods:events()
+  error("events are unsupported in the FFI module", 2)
+end
+
+function rewriter_methods:reset(options)
+  if options ~= nil then
+    if options.sink ~= nil then
+      check_sink(options.sink)
+      self.sink = options.sink
+    end
+    self.context = options.context
+  else
+    self.context = nil
+  end
+  self.has_context = self.context ~= nil
+  if self.ptr ~= nil then
+    free(self)
+  end
+  if not build(self) then
+    return last_error()
+  end
+  return self
+end
+
+return _M
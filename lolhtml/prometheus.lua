@@ -0,0 +1,61 @@
+--- Formats `lolhtml.metrics()` in the Prometheus text exposition format.
+--
+--     local prometheus = require "lolhtml.prometheus"
+--     local body = prometheus.format()
+--
+-- The metrics are specific to the calling Lua state, so a `labels` string
+-- (e.g. `'worker="3"'`) can be given to tell the states apart.
+
+local lolhtml = require "lolhtml"
+
+local concat = table.concat
+
+local gauges = {
+  { "builders", "Live RewriterBuilder objects" },
+  { "rewriters", "Live Rewriter objects" },
+  { "selectors", "Live Selector objects" },
+  { "templates", "Live BuilderTemplate objects" },
+  { "handlers", "Content handlers attached to live builders" },
+  { "registry_slots", "Slots used in the internal references table" },
+  -- only with the allocation hook
+  { "native_bytes", "Native memory allocated on behalf of this state" },
+  { "native_bytes_process", "Native memory allocated by the module in the process" },
+}
+
+local counters = {
+  { "builders_total", "RewriterBuilder objects created" },
+  { "rewriters_total", "Rewriter objects created" },
+  { "selectors_total", "Selector objects created" },
+  { "templates_total", "BuilderTemplate objects created" },
+  { "handlers_total", "Content handlers created" },
+  { "documents_total", "Documents started, including resets" },
+}
+
+-- reused between calls, scraping should not create garbage beyond the result
+local metrics, buf = {}, {}
+
+local function add(n, defs, kind, labels)
+  for _, def in ipairs(defs) do
+    local value = metrics[def[1]]
+    if value then
+      local name = "lolhtml_" .. def[1]
+      buf[n + 1] = "# HELP " .. name .. " " .. def[2]
+      buf[n + 2] = "# TYPE " .. name .. " " .. kind
+      buf[n + 3] = name .. labels .. " " .. string.format("%d", value)
+      n = n + 3
+    end
+  end
+  return n
+end
+
+local function format(labels)
+  labels = labels and ("{" .. labels .. "}") or ""
+  lolhtml.metrics(metrics)
+  local n = add(0, gauges, "gauge", labels)
+  n = add(n, counters, "counter", labels)
+  return concat(buf, "\n", 1, n) .. "\n"
+end
+
+return {
+  format = format,
+}
@@ -56,6 +56,71 @@ describe("lolhtml rewriter", function()
     assert_equal(buf:value(), basic_page)
   end)
 
+  describe("context", function()
+    test("passed to handlers and sink", function()
+      local builder = lolhtml.new_rewriter_builder()
+        :add_document_content_handlers {
+          comment_handler = function(comment, ctx)
+            table.insert(ctx.calls, "comment " .. comment:get_text())
+          end,
+        }
+        :add_element_content_handlers {
+          selector = lolhtml.new_selector("h1"),
+          element_handler = function(el, ctx)
+            table.insert(ctx.calls, "element " .. el:get_tag_name())
+          end,
+        }
+      collectgarbage("collect") -- loose the ref to the handler functions
+
+      -- the same builder is used for different documents with their own state
+      for i=1, 2 do
+        local ctx = { calls = {}, out = {} }
+        local rewriter = lolhtml.new_rewriter {
+          builder = builder,
+          context = ctx,
+          sink = function(s, c) table.insert(c.out, s) end,
+        }
+        assert(rewriter:write(basic_page))
+        assert(rewriter:close())
+        assert_equal(table.concat(ctx.out), basic_page)
+        assert_same(ctx.calls, { "comment hello, comments", "element h1" })
+      end
+    end)
+
+    test("interleaved rewriters", function()
+      local builder = lolhtml.new_rewriter_builder()
+        :add_element_content_handlers {
+          selector = lolhtml.new_selector("b"),
+          element_handler = function(el, ctx) el:set_inner_content(ctx) end,
+        }
+      local buf1, buf2 = sink_buffer(), sink_buffer()
+      local r1 = lolhtml.new_rewriter { builder=builder, sink=buf1, context="one" }
+      local r2 = lolhtml.new_rewriter { builder=builder, sink=buf2, context="two" }
+      assert(r1:write("<b>x</b>"))
+      assert(r2:write("<b>x</b>"))
+      assert(r1:write("<b>y</b>"))
+      assert(r1:close())
+      assert(r2:close())
+      assert_equal(buf1:value(), "<b>one</b><b>one</b>")
+      assert_equal(buf2:value(), "<b>two</b>")
+    end)
+
+    test("no context", function()
+      local nargs = {}
+      local builder = lolhtml.new_rewriter_builder()
+        :add_document_content_handlers {
+          doc_end_handler = function(...) table.insert(nargs, select("#", ...)) end,
+        }
+      local rewriter = lolhtml.new_rewriter {
+        builder = builder,
+        sink = function(...) table.insert(nargs, select("#", ...)) end,
+      }
+      assert(rewriter:write("hello"))
+      assert(rewriter:close())
+      for _, n in ipairs(nargs) do assert_equal(n, 1) end
+    end)
+  end)
+
   describe("document content handlers", function()
     test("doctype handler", function()
       local data, buf = nil, sink_buffer()
@@ -369,6 +434,946 @@ describe("lolhtml rewriter", function()
     assert_nil(rewriter:write("world"))
   end)
 
+  describe("reset", function()
+    test("reuse for several documents", function()
+      local calls = 0
+      local builder = lolhtml.new_rewriter_builder()
+        :add_element_content_handlers {
+          selector = lolhtml.new_selector("b"),
+          element_handler = function(el, ctx)
+            calls = calls + 1
+            el:set_inner_content(ctx)
+          end,
+        }
+      local buf = sink_buffer()
+      local rewriter = lolhtml.new_rewriter { builder=builder, sink=buf, context="first" }
+      assert(rewriter:write("<b>x</b>"))
+      assert(rewriter:close())
+      assert_equal(buf:value(), "<b>first</b>")
+
+      local buf2 = sink_buffer()
+      assert_equal(rewriter:reset { sink=buf2, context="second" }, rewriter)
+      assert(rewriter:write("<b>y</b>"))
+      assert(rewriter:close())
+      assert_equal(buf2:value(), "<b>second</b>")
+      assert_equal(calls, 2)
+
+      -- keep the previous sink when not given, context is cleared
+      assert(rewriter:reset { context = "third" })
+      assert(rewriter:write("<i>z</i>"):close())
+      assert_equal(buf2:value(), "<b>second</b><i>z</i>")
+    end)
+
+    test("after errors", function()
+      local error_object = {}
+      local rewriter = lolhtml.new_rewriter {
+        builder = lolhtml.new_rewriter_builder(),
+        sink = function() error(error_object) end,
+      }
+      local ok, err = rewriter:write("hello")
+      assert_nil(ok)
+      assert_equal(err, error_object)
+
+      local buf = sink_buffer()
+      assert(rewriter:reset { sink = buf })
+      assert(rewriter:write("hello"))
+      assert(rewriter:close())
+      assert_equal(buf:value(), "hello")
+    end)
+
+    test("unclosed document", function()
+      local buf = sink_buffer()
+      local rewriter = lolhtml.new_rewriter { builder=lolhtml.new_rewriter_builder(), sink=buf }
+      assert(rewriter:write("<p>abandonned"))
+      local buf2 = sink_buffer()
+      assert(rewriter:reset { sink = buf2 })
+      assert(rewriter:write("<p>hello</p>"):close())
+      assert_equal(buf2:value(), "<p>hello</p>")
+    end)
+
+    test("from a handler", function()
+      local rewriter
+      rewriter = lolhtml.new_rewriter {
+        builder = lolhtml.new_rewriter_builder()
+          :add_document_content_handlers {
+            text_handler = function() rewriter:reset() end,
+          },
+        sink = function() end,
+      }
+      local ok, err = rewriter:write("hello")
+      assert_nil(ok)
+      assert_type(err, "string")
+    end)
+  end)
+
+  describe("builder templates", function()
+    local tpl_entries = {
+      { selector = "a[href]", element_handler = "link", text_handler = "link_text" },
+      { selector = "h1", element_handler = "title" },
+      { doc_end_handler = "done" },
+    }
+
+    test("bind", function()
+      local tpl = lolhtml.new_builder_template(tpl_entries)
+      local links, text, done = {}, {}, false
+      local builder = tpl:bind {
+        link = function(el) table.insert(links, el:get_attribute("href")) end,
+        link_text = function(t) table.insert(text, t:get_text()) end,
+        done = function(doc_end) done = true; doc_end:append("!") end,
+        -- the "title" slot is left unbound
+      }
+      tpl = nil
+      collectgarbage("collect") -- the builder keeps the template alive
+
+      local buf = sink_buffer()
+      local rewriter = lolhtml.new_rewriter { builder=builder, sink=buf }
+      assert(rewriter:write('<h1>t</h1><a href="/x">foo</a><a>bar</a>'))
+      assert(rewriter:close())
+      assert_equal(buf:value(), '<h1>t</h1><a href="/x">foo</a><a>bar</a>!')
+      assert_same(links, { "/x" })
+      assert_equal(table.concat(text), "foo")
+      assert_true(done)
+    end)
+
+    test("end tag handlers", function()
+      local tpl = lolhtml.new_builder_template {
+        { selector = "section", element_handler = "open", end_tag_handler = "close" },
+      }
+      local values, n = {}, 0
+      local builder = tpl:bind {
+        open = function(el) n = n + 1; el:set_user_value(n) end,
+        close = function(_, value) values[#values+1] = value end,
+      }
+      local rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+      assert(rewriter:write("<section><section></section></section>"):close())
+      assert_same(values, { 2, 1 })
+    end)
+
+    test("options", function()
+      local tpl = lolhtml.new_builder_template {
+        { selector = "a", element_handler = true, attributes = { "href" } },
+        { selector = "p", text_handler = "text", text_handler_mode = "node", max_text_length = 3 },
+        { selector = "h1", element_handler = "title", capture_content = "text" },
+        { selector = "b", element_handler = "bold", batch = true },
+      }
+      local texts, title, batches = {}, nil, {}
+      local builder = tpl:bind {
+        text = function(text) texts[#texts+1] = text end,
+        title = function(text) title = text end,
+        bold = function(events) batches[#batches+1] = #events end,
+      }
+      local rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+      local hrefs = {}
+      for ev in rewriter:events('<a href="/x"></a><p>hello</p><h1>t<i>i</i></h1><b></b><b></b>') do
+        hrefs[#hrefs+1] = ev.attributes.href
+      end
+      assert(rewriter:close())
+      assert_same(hrefs, { "/x" })
+      assert_same(texts, { "hel" })
+      assert_equal(title, "ti")
+      assert_same(batches, { 2 })
+
+      assert_error(function()
+        lolhtml.new_builder_template { { selector = "a", attributes = "href" } }
+      end)
+      assert_error(function()
+        lolhtml.new_builder_template { { selector = "p", max_text_length = -1 } }
+      end)
+      -- checked when bound
+      tpl = lolhtml.new_builder_template { { selector = "p", element_handler = "f", capture_content = "foo" } }
+      assert_error(function() tpl:bind { f = function() end } end)
+    end)
+
+    test("import", function()
+      local tpl = lolhtml.new_builder_template(tpl_entries)
+      local imported = lolhtml.import_builder_template(tpl:token())
+      tpl = nil
+      collectgarbage("collect") -- the imported reference is still alive
+
+      local called = 0
+      local builder = imported:bind { title = function() called = called + 1 end }
+      local rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+      assert(rewriter:write("<h1>hello</h1>"):close())
+      assert_equal(called, 1)
+      assert_error(function() lolhtml.import_builder_template("foo") end)
+
+      -- tokens of collected templates are rejected
+      local token = lolhtml.new_builder_template(tpl_entries):token()
+      collectgarbage("collect")
+      assert_error(function() lolhtml.import_builder_template(token) end)
+    end)
+
+    test("errors", function()
+      local ok, err = lolhtml.new_builder_template { { selector = "a[href=" } }
+      assert_nil(ok)
+      assert_type(err, "string")
+      assert_error(function() lolhtml.new_builder_template { "a" } end)
+      assert_error(function() lolhtml.new_builder_template { { selector = "a", element_handler = print } } end)
+    end)
+  end)
+
+  test("stats", function()
+    local builder = lolhtml.new_rewriter_builder()
+      :add_document_content_handlers {
+        doctype_handler = function() end,
+        comment_handler = function() end,
+        doc_end_handler = function() end,
+      }
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("h1"),
+        element_handler = function() end,
+        text_handler = function() end,
+      }
+    local buf = sink_buffer()
+    local rewriter = lolhtml.new_rewriter { builder=builder, sink=buf }
+    local stats = rewriter:stats()
+    assert_equal(stats.bytes_in, 0)
+    assert_equal(stats.callbacks, 0)
+
+    local half = math.floor(#basic_page / 2)
+    assert(rewriter:write(basic_page:sub(1, half)))
+    assert(rewriter:write(basic_page:sub(half + 1)))
+    assert(rewriter:close())
+
+    local t = {}
+    assert_equal(rewriter:stats(t), t)
+    assert_equal(t.bytes_in, #basic_page)
+    assert_equal(t.bytes_out, #basic_page)
+    assert_equal(t.writes, 2)
+    assert_true(t.sink_calls >= 1)
+    assert_equal(t.doctype_callbacks, 1)
+    assert_equal(t.comment_callbacks, 1)
+    assert_equal(t.doc_end_callbacks, 1)
+    assert_equal(t.element_callbacks, 1)
+    assert_true(t.text_callbacks >= 2) -- at least the text and the last empty chunk
+    assert_equal(t.callbacks, t.doctype_callbacks + t.comment_callbacks +
+      t.doc_end_callbacks + t.element_callbacks + t.text_callbacks)
+
+    -- counters are cleared for the next document
+    assert(rewriter:reset())
+    assert_equal(rewriter:stats().bytes_in, 0)
+  end)
+
+  test("timings", function()
+    local function busy_wait(n)
+      local x = 0
+      for i=1, n do x = x + i end
+      return x
+    end
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        element_handler = function() busy_wait(100000) end,
+      }
+    local rewriter = lolhtml.new_rewriter {
+      builder = builder,
+      sink = function() busy_wait(1000) end,
+      timing = true,
+    }
+    assert(rewriter:write("<p>hello</p><p>world</p>"):close())
+    local t = {}
+    assert_equal(rewriter:timings(t), t)
+    assert_true(t.handler_ns > 0)
+    assert_true(t.sink_ns > 0)
+    assert_true(t.parser_ns >= 0)
+    assert_equal(t.total_ns, t.parser_ns + t.handler_ns + t.sink_ns)
+
+    -- batch handlers are called after lol-html returns, but within the write
+    builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        batch = true,
+        element_handler = function() busy_wait(100000) end,
+      }
+    rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end, timing=true }
+    assert(rewriter:write("<p>hello</p>"):write("<p>world</p>"):close())
+    t = rewriter:timings()
+    assert_true(t.handler_ns > 0)
+    assert_true(t.parser_ns >= 0)
+    assert_true(t.handler_ns <= t.total_ns)
+    assert_equal(t.total_ns, t.parser_ns + t.handler_ns + t.sink_ns)
+
+    -- disabled by default
+    rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+    assert(rewriter:write("<p>hello</p>"):close())
+    t = rewriter:timings()
+    assert_equal(t.total_ns, 0)
+    assert_equal(t.handler_ns, 0)
+  end)
+
+  test("latency", function()
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("title"),
+        text_handler = function() end,
+      }
+    local rewriter = lolhtml.new_rewriter {
+      builder = builder,
+      sink = function() end,
+      latency = true,
+    }
+    -- the tag name is incomplete, so it must be held back
+    assert(rewriter:write("<tit"))
+    local t = rewriter:latency()
+    assert_equal(t.held_bytes, 4)
+    assert_equal(t.held_writes, 1)
+    assert(rewriter:write("le>hello</title><p>world</p>"):close())
+    t = rewriter:latency()
+    assert_equal(t.held_bytes, 0)
+    assert_equal(t.held_writes, 0)
+    assert_equal(t.released_writes, 2)
+    assert_equal(t.max_held_bytes, 4 + 28)
+    assert_true(t.max_hold_ns > 0)
+    assert_true(t.mean_hold_ns <= t.max_hold_ns)
+
+    local h = rewriter:latency_histogram()
+    assert_equal(#h, 24)
+    local total = 0
+    for _, n in ipairs(h) do total = total + n end
+    assert_equal(total, 2)
+
+    assert(rewriter:reset())
+    assert_equal(rewriter:latency().released_writes, 0)
+  end)
+
+  test("dump trace", function()
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector('a[href="x"]'),
+        element_handler = function() end,
+      }
+    local path = os.tmpname()
+    local function dump(rewriter)
+      assert_equal(rewriter:dump_trace(path), rewriter)
+      local f = assert(io.open(path))
+      local json = f:read("*a")
+      f:close()
+      os.remove(path)
+      return json
+    end
+
+    local rewriter = lolhtml.new_rewriter {
+      builder = builder,
+      sink = function() end,
+      trace = true,
+    }
+    assert(rewriter:write('<a href="x">hello</a>'):close())
+    local json = dump(rewriter)
+    assert_match('"name":"write"', json)
+    assert_match('"name":"element"', json)
+    assert_match('"selector":"a%[href=\\"x\\"%]"', json)
+    assert_match('"name":"sink"', json)
+    assert_match('"name":"close"', json)
+    assert_match('"dropped_events":0', json)
+
+    -- only the last 2 events are kept
+    rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end, trace=2 }
+    assert(rewriter:write('<a href="x">hello</a>'):close())
+    json = dump(rewriter)
+    local _, n = json:gsub('"ph":', "")
+    assert_equal(n, 2)
+    assert_match('"dropped_events":[1-9]', json)
+
+    -- disabled by default
+    rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+    local ok, err = rewriter:dump_trace(path)
+    assert_nil(ok)
+    assert_equal(err, "tracing is not enabled")
+
+    assert_error(function()
+      lolhtml.new_rewriter { builder=builder, sink=function() end, trace=-1 }
+    end)
+  end)
+
+  test("metrics", function()
+    collectgarbage("collect")
+    local before = lolhtml.metrics()
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        element_handler = function() end,
+        text_handler = function() end,
+      }
+    local rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+    assert(rewriter:reset())
+
+    local t = {}
+    assert_equal(lolhtml.metrics(t), t)
+    assert_equal(t.builders, before.builders + 1)
+    assert_equal(t.rewriters, before.rewriters + 1)
+    assert_equal(t.selectors, before.selectors + 1)
+    assert_equal(t.handlers, before.handlers + 2)
+    assert_equal(t.handlers_total, before.handlers_total + 2)
+    assert_equal(t.documents_total, before.documents_total + 2)
+    assert_true(t.registry_slots > 0)
+
+    builder, rewriter = nil, nil
+    collectgarbage("collect")
+    collectgarbage("collect")
+    t = lolhtml.metrics()
+    assert_equal(t.builders, before.builders)
+    assert_equal(t.rewriters, before.rewriters)
+    assert_equal(t.selectors, before.selectors)
+    assert_equal(t.handlers, before.handlers)
+    assert_equal(t.builders_total, before.builders_total + 1)
+
+    local text = require("lolhtml.prometheus").format('worker="1"')
+    assert_match('\nlolhtml_rewriters{worker="1"} %d+\n', text)
+    assert_match('# TYPE lolhtml_documents_total counter\n', text)
+  end)
+
+  test("native memory metrics", function()
+    -- only available when built with ALLOC_HOOK=1
+    if not lolhtml.metrics().native_bytes then return end
+    local before = lolhtml.metrics().native_bytes
+    local rewriter = lolhtml.new_rewriter {
+      builder = lolhtml.new_rewriter_builder(),
+      sink = function() end,
+      preallocated_parsing_buffer_size = 1024 * 1024,
+    }
+    local t = lolhtml.metrics()
+    assert_true(t.native_bytes >= before + 1024 * 1024)
+    assert_true(t.native_bytes_process >= t.native_bytes)
+    rewriter = nil
+    collectgarbage("collect")
+    assert_true(lolhtml.metrics().native_bytes < before + 1024 * 1024)
+  end)
+
+  test("capture", function()
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        element_handler = function() end,
+      }
+    local captured
+    local rewriter = lolhtml.new_rewriter {
+      builder = builder,
+      sink = function() end,
+      capture = {
+        max_callbacks = 2,
+        max_bytes = 20,
+        hook = function(c) captured = c end,
+      },
+    }
+    -- not enough callbacks
+    assert(rewriter:write("<p>hello</p>"):close())
+    assert_nil(captured)
+
+    assert(rewriter:reset())
+    assert(rewriter:write("<p>hello</p>"):write("<p>world</p>"):close())
+    assert_equal(captured.data, "<p>hello</p><p>world")
+    assert_true(captured.truncated)
+    assert_equal(captured.bytes_in, 24)
+    assert_equal(captured.callbacks, 2)
+    assert_equal(#captured.chunks, 2)
+    assert_equal(captured.chunks[1].len, 12)
+    assert_equal(captured.chunks[2].len, 8)
+    assert_true(captured.total_ns > 0)
+
+    -- hook errors are propagated
+    rewriter = lolhtml.new_rewriter {
+      builder = builder,
+      sink = function() end,
+      capture = { hook = function() error("hook error") end },
+    }
+    assert(rewriter:write("<p>hello</p>"))
+    assert_error(function() rewriter:close() end)
+
+    assert_error(function()
+      lolhtml.new_rewriter { builder=builder, sink=function() end, capture={} }
+    end)
+    for _, field in ipairs { "max_bytes", "threshold_ms", "max_callbacks" } do
+      assert_error(function()
+        lolhtml.new_rewriter {
+          builder = builder,
+          sink = function() end,
+          capture = { hook = function() end, [field] = -1 },
+        }
+      end)
+    end
+  end)
+
+  test("record", function()
+    local path = os.tmpname()
+    os.remove(path)
+    local rewriter = lolhtml.new_rewriter {
+      builder = lolhtml.new_rewriter_builder(),
+      sink = function() end,
+      record = path,
+    }
+    assert(rewriter:write("<p>hello"):write("</p>"):close())
+    assert(rewriter:reset())
+    assert(rewriter:write("<br>"):close())
+    rewriter = nil
+    collectgarbage("collect")
+
+    local f = assert(io.open(path, "rb"))
+    local data = f:read("*a")
+    f:close()
+    os.remove(path)
+
+    assert_equal(data:sub(1, 8), "LOLREC01")
+    local records, pos = {}, 9
+    while pos <= #data do
+      local len = data:byte(pos + 9) + data:byte(pos + 10) * 256
+      table.insert(records, data:sub(pos, pos) .. data:sub(pos + 13, pos + 12 + len))
+      pos = pos + 13 + len
+    end
+    assert_equal(table.concat(records, ","), "D,W<p>hello,W</p>,C,D,W<br>,C")
+  end)
+
+  test("events", function()
+    local builder = lolhtml.new_rewriter_builder()
+      :add_document_content_handlers {
+        comment_handler = true,
+      }
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("a"),
+        element_handler = true,
+        text_handler = true,
+        attributes = { "href", "title" },
+      }
+    local buf = sink_buffer()
+    local rewriter = lolhtml.new_rewriter { builder=builder, sink=buf }
+
+    local events = {}
+    for ev in rewriter:events('<!--c--><a href="/x">li') do
+      events[#events+1] = ev
+    end
+    assert_equal(#events, 3)
+    assert_equal(events[1].type, "comment")
+    assert_equal(events[1].text, "c")
+    assert_nil(events[1].selector)
+    assert_equal(events[2].type, "element")
+    assert_equal(events[2].selector, "a")
+    assert_equal(events[2].tag, "a")
+    assert_equal(events[2].attributes.href, "/x")
+    assert_nil(events[2].attributes.title)
+    assert_equal(events[3].type, "text")
+    assert_equal(events[3].text, "li")
+    assert_equal(events[3].last, false)
+
+    -- reused table, and close
+    local t, text, n = {}, {}, 0
+    for ev in rewriter:events("nk</a>", t) do
+      assert_true(ev == t)
+      text[#text+1] = ev.text
+      n = n + 1
+    end
+    for ev in rewriter:events(nil, t) do n = n + 1 end
+    assert_equal(table.concat(text), "nk")
+    assert_true(n >= 1)
+    assert_nil(t.tag)
+    assert_equal(buf:value(), '<!--c--><a href="/x">link</a>')
+
+    -- errors are raised
+    assert_error(function() for _ in rewriter:events("foo") do end end)
+  end)
+
+  test("event attribute names are copied", function()
+    local names = { "href" }
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("a"),
+        element_handler = true,
+        attributes = names,
+      }
+    names[1] = "title"
+    names = nil
+    collectgarbage()
+    collectgarbage()
+    local rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+    local href
+    for ev in rewriter:events('<a href="/x" title="t">') do
+      href = ev.attributes.href
+      assert_nil(ev.attributes.title)
+    end
+    assert_equal(href, "/x")
+    -- the iterator function checks its state
+    local next_event = rewriter:events("")
+    assert_error(function() next_event({}) end)
+  end)
+
+  test("batch handlers", function()
+    local batches, texts = {}, {}
+    local builder = lolhtml.new_rewriter_builder()
+      :add_document_content_handlers {
+        batch = true,
+        text_handler = function(events, ctx)
+          assert_equal(ctx, "ctx")
+          for _, ev in ipairs(events) do texts[#texts+1] = ev.text end
+        end,
+      }
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("a"),
+        batch = true,
+        attributes = { "href" },
+        element_handler = function(events)
+          batches[#batches+1] = events
+          if events[1].attributes.href == "boom" then error("boom") end
+        end,
+      }
+    local rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end, context="ctx" }
+    assert(rewriter:write('<a href="1">x</a><a href="2">y</a>'))
+    assert_equal(#batches, 1)
+    assert_equal(#batches[1], 2)
+    assert_equal(batches[1][1].tag, "a")
+    assert_equal(batches[1][2].attributes.href, "2")
+    -- not called without events
+    assert(rewriter:write("z"))
+    assert(rewriter:close())
+    assert_equal(#batches, 1)
+    assert_equal(table.concat(texts), "xyz")
+    -- not returned by Rewriter:events
+    assert(rewriter:reset { context="ctx" })
+    for ev in rewriter:events('<a href="3">') do error("unexpected event") end
+    assert_equal(#batches, 2)
+
+    assert(rewriter:reset { context="ctx" })
+    local ok, err = rewriter:write('<a href="boom">')
+    assert_nil(ok)
+    assert_match("boom", err)
+    assert_equal(rewriter:write("foo"), nil)
+  end)
+
+  test("output returned without sink", function()
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("h1"),
+        element_handler = function(el) el:set_attribute("class", "title") end,
+      }
+    local rewriter = lolhtml.new_rewriter { builder=builder }
+    local out = {}
+    for i=1, #basic_page, 10 do
+      local chunk = assert(rewriter:write(basic_page:sub(i, i+9)))
+      assert_equal(type(chunk), "string")
+      out[#out+1] = chunk
+    end
+    out[#out+1] = assert(rewriter:close())
+    assert_equal(table.concat(out), (basic_page:gsub("<h1>", '<h1 class="title">')))
+
+    assert_error(function() rewriter:reset { sink=function() end } end)
+    assert(rewriter:reset())
+    assert_equal(rewriter:write(""), "")
+    assert_error(function() rewriter:events("<h1>") end)
+  end)
+
+  test("text views", function()
+    local view
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        text_handler = function(t)
+          if t:get_text() == "" then return end
+          view = t:view()
+          assert_equal(view:len(), 11)
+          assert_equal(view:byte(), string.byte("h"))
+          assert_equal(view:byte(-1), string.byte("d"))
+          assert_nil(view:byte(12))
+          assert_equal(view:sub(1, 5), "hello")
+          assert_equal(view:sub(-5), "world")
+          assert_equal(view:sub(4, 2), "")
+          local s, e = view:find("o")
+          assert_equal(s, 5)
+          assert_equal(e, 5)
+          s, e = view:find("o", 6)
+          assert_equal(s, 8)
+          assert_equal(e, 8)
+          s, e = view:find("o w")
+          assert_equal(s, 5)
+          assert_equal(e, 7)
+          assert_nil(view:find("xyz"))
+          assert_true(view:startswith("hello"))
+          assert_true(not view:startswith("world"))
+          assert_true(view:equals("hello world"))
+          assert_true(not view:equals("hello"))
+          assert_equal(tostring(view), "hello world")
+        end,
+      }
+    local rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+    assert(rewriter:write("<p>hello world</p>"):close())
+    assert_true(view ~= nil)
+    assert_error(function() view:len() end)
+  end)
+
+  test("text node mode", function()
+    local texts, chunks = {}, {}
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        text_handler_mode = "node",
+        max_text_length = 8,
+        text_handler = function(text, ctx)
+          assert_equal(type(text), "string")
+          assert_equal(ctx, "ctx")
+          texts[#texts+1] = text
+        end,
+      }
+      :add_document_content_handlers {
+        text_handler = function(t) chunks[#chunks+1] = t:get_text() end,
+      }
+    local rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end, context="ctx" }
+    for _, chunk in ipairs { "<p>hel", "lo</p><p>a very long", " text</p>" } do
+      assert(rewriter:write(chunk))
+    end
+    assert(rewriter:close())
+    assert_true(#chunks > 2)
+    assert_equal(#texts, 2)
+    assert_equal(texts[1], "hello")
+    assert_equal(texts[2], "a very l")
+
+    assert_error(function()
+      lolhtml.new_rewriter_builder():add_document_content_handlers {
+        text_handler_mode = "foo", text_handler = function() end,
+      }
+    end)
+    assert_error(function()
+      lolhtml.new_rewriter_builder():add_document_content_handlers {
+        text_handler_mode = "node", max_text_length = -1, text_handler = function() end,
+      }
+    end)
+  end)
+
+  test("element capture", function()
+    local texts, htmls = {}, {}
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("div"),
+        capture_content = "text",
+        element_handler = function(text, ctx)
+          assert_equal(type(text), "string")
+          assert_equal(ctx, "ctx")
+          texts[#texts+1] = text
+        end,
+      }
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        capture_content = "html",
+        max_capture_length = 12,
+        element_handler = function(html) htmls[#htmls+1] = html end,
+      }
+    local out = {}
+    local rewriter = lolhtml.new_rewriter {
+      builder = builder,
+      sink = function(s) out[#out+1] = s end,
+      context = "ctx",
+    }
+    local doc = "<div>a<div>b</div>c</div><p>x<b>y</b></p><p>a very long paragraph</p>"
+    for i=1, #doc, 5 do
+      assert(rewriter:write(doc:sub(i, i+4)))
+    end
+    assert(rewriter:close())
+    assert_equal(table.concat(out), doc)
+    assert_equal(#texts, 2)
+    assert_equal(texts[1], "b")
+    assert_equal(texts[2], "abc")
+    assert_equal(#htmls, 2)
+    assert_equal(htmls[1], "x<b>y</b>")
+    assert_equal(htmls[2], "a very long ")
+
+    -- the document can't forge the capture markers
+    texts, htmls, out = {}, {}, {}
+    assert(rewriter:reset { sink = function(s) out[#out+1] = s end, context = "ctx" })
+    doc = "<div><!--lolhtml:capture:0--><!--lolhtml:capture:1-->x</div><p>y</p>"
+    assert(rewriter:write(doc))
+    assert(rewriter:close())
+    assert_equal(table.concat(out), doc)
+    assert_equal(texts[1], "x")
+    assert_equal(htmls[1], "y")
+
+    -- elements left open are captured by close
+    texts, htmls = {}, {}
+    assert(rewriter:reset { sink = function() end, context = "ctx" })
+    assert(rewriter:write("<div>a<div>b"))
+    assert_equal(#texts, 0)
+    assert(rewriter:write("<p>c"))
+    assert(rewriter:close())
+    assert_equal(texts[1], "bc")
+    assert_equal(texts[2], "abc")
+    assert_equal(htmls[1], "c")
+
+    assert_error(function()
+      lolhtml.new_rewriter_builder():add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        capture_content = "foo", element_handler = function() end,
+      }
+    end)
+    assert_error(function()
+      lolhtml.new_rewriter_builder():add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        capture_content = "text", max_capture_length = -1, element_handler = function() end,
+      }
+    end)
+  end)
+
+  test("nested capture limits", function()
+    local texts, htmls = {}, {}
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("div"),
+        capture_content = "text",
+        max_capture_length = 3,
+        element_handler = function(text) texts[#texts+1] = text end,
+      }
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("section"),
+        capture_content = "html",
+        max_capture_length = 5,
+        element_handler = function(html) htmls[#htmls+1] = html end,
+      }
+    local rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+    -- the outer elements are full before the inner ones start
+    assert(rewriter:write("<div>abcdef<div>ghij</div>k<div>l</div></div>"))
+    assert(rewriter:write("<section>01234567<section>inner</section></section>"))
+    assert(rewriter:close())
+    assert_equal(#texts, 3)
+    assert_equal(texts[1], "ghi")
+    assert_equal(texts[2], "l")
+    assert_equal(texts[3], "abc")
+    assert_equal(#htmls, 2)
+    assert_equal(htmls[1], "inner")
+    assert_equal(htmls[2], "01234")
+  end)
+
+  test("end tag handlers", function()
+    local depths, values = {}, {}
+    local depth = 0
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("div"),
+        element_handler = function(el)
+          depth = depth + 1
+          el:set_user_value(depth)
+          assert_equal(el:get_user_value(), depth)
+        end,
+        end_tag_handler = function(end_tag, value, ctx)
+          assert_equal(end_tag:get_name(), "div")
+          assert_equal(ctx, "ctx")
+          depths[#depths+1] = value
+          depth = depth - 1
+          end_tag:after("!")
+        end,
+      }
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        element_handler = function(el) el:set_user_value({ el:get_tag_name() }) end,
+        end_tag_handler = function(end_tag, value) values[#values+1] = value end,
+      }
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("span"),
+        end_tag_handler = function(end_tag, value) values[#values+1] = tostring(value) end,
+      }
+    local rewriter = lolhtml.new_rewriter { builder=builder, context="ctx" }
+    local out = rewriter:write("<div><div>a</div><p>b</p></div><span></span>")
+    out = out .. rewriter:close()
+    assert_equal(out, "<div><div>a</div>!<p>b</p></div>!<span></span>")
+    assert_equal(#depths, 2)
+    assert_equal(depths[1], 2)
+    assert_equal(depths[2], 1)
+    assert_equal(#values, 2)
+    assert_equal(values[1][1], "p")
+    assert_equal(values[2], "nil")
+    assert_equal(rewriter:stats().end_tag_callbacks, 4)
+
+    assert_error(function()
+      lolhtml.new_rewriter_builder():add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        end_tag_handler = true,
+      }
+    end)
+  end)
+
+  test("element snapshot", function()
+    local snap, attrs, out = {}, {}, { other = 1 }
+    local tags, ids, hrefs = {}, {}, {}
+    local builder = lolhtml.new_rewriter_builder()
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("*"),
+        element_handler = function(el)
+          assert_equal(el:snapshot(snap), snap)
+          tags[#tags+1] = snap.tag
+          ids[#ids+1] = snap.attributes.id or false
+          assert_equal(snap.namespace, "http://www.w3.org/1999/xhtml")
+          assert_equal(el:get_attributes({ "href", "id" }, out), out)
+          hrefs[#hrefs+1] = out.href or false
+        end,
+      }
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("a"),
+        element_handler = function(el)
+          local t = el:snapshot()
+          assert_equal(t.attributes.href, "/x")
+          assert_equal(t.attributes.class, "c")
+          attrs = el:get_attributes { "class", "missing" }
+        end,
+      }
+    local rewriter = lolhtml.new_rewriter { builder=builder }
+    rewriter:write('<p id="a"><a href="/x" class="c">x</a><b></b></p>')
+    rewriter:close()
+    assert_equal(table.concat(tags, ","), "p,a,b")
+    assert_equal(ids[1], "a")
+    assert_equal(ids[2], false)
+    assert_equal(ids[3], false)
+    assert_equal(hrefs[1], false)
+    assert_equal(hrefs[2], "/x")
+    assert_equal(hrefs[3], false)
+    assert_equal(out.other, 1)
+    assert_equal(attrs.class, "c")
+    assert_equal(attrs.missing, nil)
+
+    assert_error(function()
+      local b = lolhtml.new_rewriter_builder()
+        :add_element_content_handlers {
+          selector = lolhtml.new_selector("p"),
+          element_handler = function(el) el:get_attributes { 1 } end,
+        }
+      assert(lolhtml.new_rewriter { builder=b }:write("<p></p>"))
+    end)
+  end)
+
+  test("builder profile", function()
+    local builder = lolhtml.new_rewriter_builder()
+      :add_document_content_handlers {
+        doc_end_handler = function() end,
+      }
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("p"),
+        element_handler = function() end,
+        text_handler = function(t)
+          if t:get_text() == "boom" then error("boom") end
+        end,
+      }
+      :add_element_content_handlers {
+        selector = lolhtml.new_selector("blink"),
+        element_handler = function() end,
+      }
+    local rewriter = lolhtml.new_rewriter {
+      builder = builder,
+      sink = function() end,
+      timing = true,
+    }
+    assert(rewriter:write("<p>hello</p><p>world</p>"):close())
+    rewriter = lolhtml.new_rewriter { builder=builder, sink=function() end }
+    assert_nil(rewriter:write("<p>boom</p>"))
+
+    local profile = builder:profile()
+    assert_equal(#profile, 4)
+    assert_equal(profile[1].type, "doc_end")
+    assert_nil(profile[1].selector)
+    assert_equal(profile[1].calls, 1)
+    -- text handler is registered before the element handler
+    assert_equal(profile[2].selector, "p")
+    assert_equal(profile[2].type, "text")
+    assert_equal(profile[2].errors, 1)
+    assert_equal(profile[3].selector, "p")
+    assert_equal(profile[3].type, "element")
+    assert_equal(profile[3].calls, 3)
+    assert_equal(profile[3].errors, 0)
+    assert_equal(profile[4].selector, "blink")
+    assert_equal(profile[4].calls, 0)
+    assert_equal(profile[4].time_ns, 0)
+  end)
+
   test("sink throw errors", function()
     local called = false
     local error_object = {}
@@ -629,3 +1634,88 @@ describe("lolhtml rewriter", function()
     end)
   end)
 end)
+
+if jit then
+  describe("lolhtml.ffi", function()
+    local lolffi = require "lolhtml.ffi"
+
+    test("rewrites like the C module", function()
+      local buf = sink_buffer()
+      local texts = {}
+      local builder = lolffi.new_rewriter_builder()
+        :add_document_content_handlers {
+          text_handler = function(t)
+            local ptr, len = t:get_text_ptr()
+            texts[#texts+1] = require("ffi").string(ptr, len)
+          end,
+        }
+        :add_element_content_handlers {
+          selector = lolffi.new_selector("h1"),
+          element_handler = function(el, ctx)
+            el:set_attribute("class", ctx)
+          end,
+          comment_handler = function(c) c:remove() end,
+        }
+      local rewriter = lolffi.new_rewriter { builder=builder, sink=buf, context="title" }
+      assert(rewriter:write(basic_page))
+      assert(rewriter:close())
+      assert_match('<h1 class="title">', buf:value())
+      assert_match("hello, comments", buf:value()) -- the comment is not in h1
+      assert_match("Hello, Lua%-lolhtml", table.concat(texts))
+    end)
+
+    test("handler errors", function()
+      local builder = lolffi.new_rewriter_builder()
+        :add_element_content_handlers {
+          selector = lolffi.new_selector("h1"),
+          element_handler = function() error("boom") end,
+        }
+      local rewriter = lolffi.new_rewriter { builder=builder, sink=function() end }
+      local ok, err = rewriter:write(basic_page)
+      assert_nil(ok)
+      assert_match("boom", err)
+      ok, err = rewriter:write("foo")
+      assert_nil(ok)
+      assert_equal(err, "broken rewriter")
+      assert(rewriter:reset())
+      assert_nil(lolffi.new_selector("<bad"))
+    end)
+
+    test("unsupported features", function()
+      local selector = lolffi.new_selector("p")
+      local function element(callbacks)
+        callbacks.selector = selector
+        return function() lolffi.new_rewriter_builder():add_element_content_handlers(callbacks) end
+      end
+      assert_error(element { element_handler = true })
+      assert_error(element { element_handler = function() end, batch = true })
+      assert_error(element { element_handler = function() end, attributes = { "href" } })
+      assert_error(element { element_handler = function() end, capture_content = "text" })
+      assert_error(element { end_tag_handler = function() end })
+      assert_error(function()
+        lolffi.new_rewriter_builder():add_document_content_handlers {
+          text_handler = function() end, text_handler_mode = "node",
+        }
+      end)
+      assert_error(function() lolffi.new_rewriter { builder=lolffi.new_rewriter_builder() } end)
+      local rewriter = lolffi.new_rewriter { builder=lolffi.new_rewriter_builder(), sink=function() end }
+      assert_error(function() rewriter:events("<p>") end)
+    end)
+
+    test("write in a hot loop", function()
+      jit.on()
+      local count = 0
+      local builder = lolffi.new_rewriter_builder()
+        :add_element_content_handlers {
+          selector = lolffi.new_selector("p"),
+          element_handler = function() count = count + 1 end,
+        }
+      local rewriter = lolffi.new_rewriter { builder=builder, sink=function() end }
+      for _ = 1, 5000 do
+        assert(rewriter:write("<p>x</p>"))
+      end
+      assert(rewriter:close())
+      assert_equal(count, 5000)
+    end)
+  end)
+end
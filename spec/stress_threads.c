@@ -0,0 +1,139 @@
+/* Stress test for the module loaded in many independent Lua states, one per
+ * thread. Each thread creates selectors, builders and rewriters, and goes
+ * through the error paths to check that errors are never lost or mixed up
+ * between threads. They also bind their own functions to a builder template
+ * shared by all threads.
+ *
+ * Meant to be run under ThreadSanitizer, see the `test` target of the
+ * Makefile.
+ *
+ * Usage: stress_threads [threads] [iterations]
+ */
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int luaopen_lolhtml(lua_State *L);
+
+static const char script[] =
+    "local lolhtml = require 'lolhtml'\n"
+    "local id, iterations, token = ...\n"
+    "local tpl = lolhtml.import_builder_template(token)\n"
+    "local function check_err(ok, err)\n"
+    "  assert(ok == nil, 'error expected')\n"
+    "  assert(type(err) == 'string' and err ~= 'unknown error', 'lost error: ' .. tostring(err))\n"
+    "end\n"
+    "for i=1, iterations do\n"
+    "  local marker = string.format('t%d-%d', id, i)\n"
+    "  local builder = lolhtml.new_rewriter_builder()\n"
+    "    :add_element_content_handlers {\n"
+    "      selector = lolhtml.new_selector('a[href]'),\n"
+    "      element_handler = function(el, ctx) el:set_attribute('data-id', ctx) end,\n"
+    "    }\n"
+    "    :add_document_content_handlers {\n"
+    "      comment_handler = function(c) return lolhtml.STOP end,\n"
+    "    }\n"
+    "  local out = {}\n"
+    "  local rewriter = assert(lolhtml.new_rewriter {\n"
+    "    builder = builder, context = marker,\n"
+    "    sink = function(s) out[#out+1] = s end,\n"
+    "  })\n"
+    "  assert(rewriter:write('<p><a href=\"/\">link</a></p>'))\n"
+    "  assert(rewriter:close())\n"
+    "  out = table.concat(out)\n"
+    "  assert(out == '<p><a href=\"/\" data-id=\"' .. marker .. '\">link</a></p>', out)\n"
+    "  -- lol-html errors, fetched from the thread local storage\n"
+    "  check_err(lolhtml.new_selector('a[href='))\n"
+    "  check_err(lolhtml.new_rewriter { builder = builder, sink = print, encoding = 'utf-16le' })\n"
+    "  rewriter = lolhtml.new_rewriter { builder = builder, sink = function() end }\n"
+    "  check_err(rewriter:write('hello <!-- stop -->'))\n"
+    "  -- shared template\n"
+    "  local count = 0\n"
+    "  builder = tpl:bind { item = function() count = count + 1 end }\n"
+    "  rewriter = lolhtml.new_rewriter { builder = builder, sink = function() end }\n"
+    "  assert(rewriter:write('<ul><li>a<li>b</ul>'):close())\n"
+    "  assert(count == 2)\n"
+    "  if i % 10 == 0 then collectgarbage() end\n"
+    "end\n";
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int iterations;
+    void *template_token;
+    char *error;
+} worker_t;
+
+static lua_State *new_state(void) {
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    luaL_requiref(L, "lolhtml", luaopen_lolhtml, 0);
+    lua_pop(L, 1);
+    return L;
+}
+
+static void *worker(void *arg) {
+    worker_t *w = arg;
+    lua_State *L = new_state();
+
+    if (luaL_loadstring(L, script) == LUA_OK) {
+        lua_pushinteger(L, w->id);
+        lua_pushinteger(L, w->iterations);
+        lua_pushlightuserdata(L, w->template_token);
+        lua_pcall(L, 3, 0, 0);
+    }
+    if (lua_gettop(L) > 0) {
+        const char *err = lua_tostring(L, -1);
+        w->error = strdup(err ? err : "(non-string error)");
+    }
+
+    lua_close(L);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int i, failures = 0;
+    int nthreads = argc > 1 ? atoi(argv[1]) : 200;
+    int iterations = argc > 2 ? atoi(argv[2]) : 50;
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    void *token;
+
+    /* the main state holds the shared template until all threads are done */
+    lua_State *main_state = new_state();
+    if (luaL_dostring(main_state,
+            "local lolhtml = require 'lolhtml'\n"
+            "template = lolhtml.new_builder_template { { selector = 'li', element_handler = 'item' } }\n"
+            "return template:token()") != LUA_OK) {
+        fprintf(stderr, "cannot create template: %s\n", lua_tostring(main_state, -1));
+        return 1;
+    }
+    token = lua_touserdata(main_state, -1);
+
+    for (i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        workers[i].iterations = iterations;
+        workers[i].template_token = token;
+        if (pthread_create(&workers[i].thread, NULL, worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].error != NULL) {
+            fprintf(stderr, "thread %d: %s\n", i, workers[i].error);
+            free(workers[i].error);
+            failures++;
+        }
+    }
+
+    lua_close(main_state);
+    free(workers);
+    printf("%d threads, %d iterations each: %d failures\n", nthreads, iterations, failures);
+    return failures == 0 ? 0 : 1;
+}
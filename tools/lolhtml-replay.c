@@ -0,0 +1,281 @@
+/* lolhtml-replay: replays recorded traffic through a builder.
+ *
+ * Usage: lolhtml-replay [-p] [-n iterations] handler.lua recording...
+ *
+ * Recordings are made with the `record` option of rewriters (see the README
+ * for the file format). Each recorded document is fed to a rewriter with the
+ * same chunk boundaries, at full speed by default or at the original pacing
+ * with -p. The rewriter is set up by the same driver as lolhtml-rewrite (see
+ * tools/lolhtml-rewrite.lua), with the recording path as input and no output.
+ *
+ * It reports the throughput, the number of content handler calls per second
+ * and percentiles of the time spent in each `write`/`close` call, so it can be
+ * used as a regression benchmark on real workloads.
+ */
+#define _GNU_SOURCE
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lolhtml-tools.h"
+
+#ifndef DRIVER_PATH
+#define DRIVER_PATH "tools/lolhtml-rewrite.lua"
+#endif
+
+/* must match lolhtml.c */
+#define RECORD_MAGIC "LOLREC01"
+#define RECORD_HEADER_SIZE 13
+
+static struct {
+    uint64_t *ns;
+    size_t len, cap;
+} latencies;
+
+static void sleep_until(uint64_t deadline) {
+    struct timespec ts = { deadline / 1000000000, deadline % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+static void add_latency(uint64_t ns) {
+    if (latencies.len == latencies.cap) {
+        latencies.cap = latencies.cap ? latencies.cap * 2 : 1024;
+        latencies.ns = realloc(latencies.ns, latencies.cap * sizeof(uint64_t));
+        if (latencies.ns == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    latencies.ns[latencies.len++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double p) {
+    size_t i = (size_t)(p * (latencies.len - 1) + 0.5);
+    return latencies.ns[i] / 1e3;
+}
+
+static uint64_t read_le(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    int i;
+    for (i = n - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/* returns the number of content handler calls of the rewriter at index 1 */
+static uint64_t rewriter_callbacks(lua_State *L) {
+    uint64_t n;
+    lua_getfield(L, 1, "stats");
+    lua_pushvalue(L, 1);
+    if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_getfield(L, -1, "callbacks");
+    n = lua_tointeger(L, -1);
+    lua_pop(L, 2);
+    return n;
+}
+
+/* calls driver.finish(), errors are only reported */
+static void driver_finish(lua_State *L, int driver, const char *path) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, driver);
+    lua_getfield(L, -1, "finish");
+    lua_remove(L, -2);
+    if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+        fprintf(stderr, "%s: %s\n", path, lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+typedef struct {
+    size_t documents, failures;
+    uint64_t bytes, callbacks, busy_ns;
+} totals_t;
+
+/* replays all the documents of a recording */
+static int replay(lua_State *L, int driver, const char *path, const unsigned char *data,
+                  size_t size, bool paced, totals_t *totals) {
+    size_t off = sizeof(RECORD_MAGIC) - 1;
+    uint64_t doc_start = 0;
+    const char *err = NULL;
+    bool in_doc = false;
+
+    if (size < off || memcmp(data, RECORD_MAGIC, off) != 0) {
+        fprintf(stderr, "%s: not a recording\n", path);
+        return -1;
+    }
+
+    while (off + RECORD_HEADER_SIZE <= size) {
+        int type = data[off];
+        uint64_t ts = read_le(data + off + 1, 8), start;
+        size_t len = read_le(data + off + 9, 4);
+        const char *chunk = (const char *)data + off + RECORD_HEADER_SIZE;
+
+        off += RECORD_HEADER_SIZE + len;
+        if (off > size) {
+            fprintf(stderr, "%s: truncated recording\n", path);
+            return -1;
+        }
+
+        if (type == 'D') {
+            if (in_doc) {
+                /* the previous document was never closed, drop it */
+                driver_finish(L, driver, path);
+            }
+            lua_settop(L, 0);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, driver);
+            lua_getfield(L, 1, "begin");
+            lua_pushstring(L, path);
+            lua_pushnil(L);
+            if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+                fprintf(stderr, "%s: %s\n", path, lua_tostring(L, -1));
+                driver_finish(L, driver, path);
+                return -1;
+            }
+            lua_remove(L, 1); /* rewriter */
+            in_doc = true;
+            err = NULL;
+            doc_start = now_ns();
+            continue;
+        }
+        if (type != 'W' && type != 'C') {
+            fprintf(stderr, "%s: corrupt recording (record type 0x%02x)\n", path, type);
+            if (in_doc) {
+                driver_finish(L, driver, path);
+            }
+            return -1;
+        }
+        if (!in_doc || err != NULL) {
+            continue; /* skip the rest of a failed document */
+        }
+
+        if (paced) {
+            sleep_until(doc_start + ts);
+        }
+        start = now_ns();
+        err = call_rewriter(L, type == 'W' ? "write" : "close", type == 'W' ? chunk : NULL, len);
+        add_latency(now_ns() - start);
+        totals->busy_ns += now_ns() - start;
+        totals->bytes += len;
+
+        if (err != NULL) {
+            fprintf(stderr, "FAIL\t%s\tdocument %zu\t%s\n", path, totals->documents + 1, err);
+        }
+        if (type == 'C' || err != NULL) {
+            totals->documents++;
+            if (err != NULL) {
+                totals->failures++;
+            } else {
+                totals->callbacks += rewriter_callbacks(L);
+            }
+            driver_finish(L, driver, path);
+            in_doc = false;
+        }
+    }
+    if (in_doc) {
+        driver_finish(L, driver, path);
+    }
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-p] [-n iterations] handler.lua recording...\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *driver_path = getenv("LOLHTML_REWRITE_DRIVER");
+    const char *handler;
+    bool paced = false;
+    long iterations = 1, it;
+    totals_t totals = { 0 };
+    uint64_t start, wall;
+    int opt, driver, i, rc = 0;
+
+    while ((opt = getopt(argc, argv, "pn:")) != -1) {
+        switch (opt) {
+        case 'p': paced = true; break;
+        case 'n': iterations = atol(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2 || iterations < 1) {
+        usage(argv[0]);
+    }
+    handler = argv[optind++];
+
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    if (luaL_loadfile(L, driver_path ? driver_path : DRIVER_PATH) != LUA_OK
+            || lua_pcall(L, 0, 1, 0) != LUA_OK) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_pushstring(L, handler);
+    if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    driver = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    start = now_ns();
+    for (it = 0; it < iterations; it++) {
+        for (i = optind; i < argc; i++) {
+            struct stat st;
+            void *data;
+            int fd = open(argv[i], O_RDONLY);
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+                return 1;
+            }
+            data = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (data == MAP_FAILED) {
+                fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+                return 1;
+            }
+            if (replay(L, driver, argv[i], data, st.st_size, paced, &totals) != 0) {
+                rc = 1;
+            }
+            munmap(data, st.st_size ? st.st_size : 1);
+        }
+    }
+    wall = now_ns() - start;
+    lua_close(L);
+
+    printf("%zu documents, %zu failures, %zu calls\n", totals.documents, totals.failures, latencies.len);
+    if (totals.busy_ns > 0) {
+        /* throughput only counts the time spent in the rewriter, so paced
+         * replays give comparable numbers */
+        printf("%.2f MB in %.3f s (%.3f s wall time): %.2f MB/s, %.0f callbacks/s\n",
+               totals.bytes / 1e6, totals.busy_ns / 1e9, wall / 1e9,
+               totals.bytes / 1e6 / (totals.busy_ns / 1e9),
+               totals.callbacks / (totals.busy_ns / 1e9));
+    }
+    if (latencies.len > 0) {
+        qsort(latencies.ns, latencies.len, sizeof(uint64_t), cmp_u64);
+        printf("call latency (µs): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+               percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999),
+               latencies.ns[latencies.len - 1] / 1e3);
+    }
+
+    return (rc != 0 || totals.failures != 0) ? 1 : 0;
+}
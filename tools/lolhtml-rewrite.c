@@ -0,0 +1,335 @@
+/* lolhtml-rewrite: rewrites many HTML files in parallel through the Lua
+ * binding.
+ *
+ * Usage: lolhtml-rewrite [-j workers] [-o outdir] [-c chunk_size] [-v]
+ *                        handler.lua path...
+ *
+ * Each path can be a file, a directory (searched recursively for .html and
+ * .htm files) or a glob pattern. The files are distributed among the worker
+ * processes, each one pinned to a core. Workers map the files in memory and
+ * feed them to a rewriter by chunks, the output is written in `outdir`
+ * (mirroring the input paths) or discarded if no output directory is given.
+ *
+ * The Lua side is implemented by the driver script, see
+ * tools/lolhtml-rewrite.lua. Its path can be set with the
+ * LOLHTML_REWRITE_DRIVER environment variable.
+ *
+ * Per-file timings and failures are aggregated by the parent process, so it
+ * can also be used as an end-to-end throughput benchmark.
+ */
+#define _GNU_SOURCE
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <glob.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lolhtml-tools.h"
+
+#ifndef DRIVER_PATH
+#define DRIVER_PATH "tools/lolhtml-rewrite.lua"
+#endif
+
+#define ERR_MAX 256
+
+/* per-file result, stored in a shared mapping written by the workers */
+typedef struct {
+    int status; /* 0: not processed, 1: ok, -1: failed */
+    uint64_t ns;
+    size_t bytes;
+    char err[ERR_MAX];
+} result_t;
+
+static struct {
+    char **paths;
+    size_t len, cap;
+} files;
+
+static void add_file(const char *path) {
+    if (files.len == files.cap) {
+        files.cap = files.cap ? files.cap * 2 : 64;
+        files.paths = realloc(files.paths, files.cap * sizeof(char *));
+        if (files.paths == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    files.paths[files.len++] = strdup(path);
+}
+
+static int add_html_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    const char *ext = strrchr(path, '.');
+    (void)st;
+    (void)ftw;
+    if (type == FTW_F && ext != NULL && (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0)) {
+        add_file(path);
+    }
+    return 0;
+}
+
+static void add_path(const char *path) {
+    struct stat st;
+    glob_t g;
+    size_t i;
+
+    if (stat(path, &st) == 0) {
+        if (S_ISDIR(st.st_mode)) {
+            nftw(path, add_html_file, 16, FTW_PHYS);
+        } else {
+            add_file(path);
+        }
+        return;
+    }
+
+    /* not an existing path: try it as a glob pattern */
+    if (glob(path, 0, NULL, &g) != 0) {
+        fprintf(stderr, "%s: no such file\n", path);
+        exit(1);
+    }
+    for (i = 0; i < g.gl_pathc; i++) {
+        add_path(g.gl_pathv[i]);
+    }
+    globfree(&g);
+}
+
+/* creates the parent directories of `path` */
+static int mkdir_parents(char *path) {
+    char *p;
+    for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+            *p = '/';
+            return -1;
+        }
+        *p = '/';
+    }
+    return 0;
+}
+
+static void set_error(result_t *res, const char *msg) {
+    res->status = -1;
+    snprintf(res->err, ERR_MAX, "%s", msg ? msg : "(non-string error)");
+}
+
+static void process_file(lua_State *L, int driver, const char *path, const char *outdir,
+                         size_t chunk_size, result_t *res) {
+    struct stat st;
+    const char *data = NULL, *err = NULL;
+    char *out_path = NULL;
+    size_t off;
+    uint64_t start;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        set_error(res, strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    res->bytes = st.st_size;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            set_error(res, strerror(errno));
+            close(fd);
+            return;
+        }
+        madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    if (outdir != NULL) {
+        if (asprintf(&out_path, "%s/%s", outdir, path[0] == '/' ? path + 1 : path) < 0
+                || mkdir_parents(out_path) != 0) {
+            set_error(res, "cannot create output directory");
+            goto done;
+        }
+    }
+
+    start = now_ns();
+
+    lua_settop(L, 0);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, driver);    /* driver */
+    lua_getfield(L, 1, "begin");                  /* driver, begin */
+    lua_pushstring(L, path);
+    if (out_path != NULL) {
+        lua_pushstring(L, out_path);
+    } else {
+        lua_pushnil(L);
+    }
+    if (lua_pcall(L, 2, 1, 0) != LUA_OK) {        /* driver, rewriter */
+        /* begin may have opened the output before failing */
+        set_error(res, lua_tostring(L, -1));
+        goto finish;
+    }
+    lua_remove(L, 1);                             /* rewriter */
+
+    for (off = 0; err == NULL && off < (size_t)st.st_size; off += chunk_size) {
+        size_t len = st.st_size - off < chunk_size ? st.st_size - off : chunk_size;
+        err = call_rewriter(L, "write", data + off, len);
+    }
+    if (err == NULL) {
+        err = call_rewriter(L, "close", NULL, 0);
+    }
+
+    res->ns = now_ns() - start;
+    if (err != NULL) {
+        set_error(res, err);
+    } else {
+        res->status = 1;
+    }
+
+finish:
+    lua_rawgeti(L, LUA_REGISTRYINDEX, driver);
+    lua_getfield(L, -1, "finish");
+    lua_remove(L, -2);
+    if (lua_pcall(L, 0, 0, 0) != LUA_OK && res->status > 0) {
+        set_error(res, lua_tostring(L, -1));
+    }
+
+done:
+    free(out_path);
+    if (data != NULL) {
+        munmap((void *)data, st.st_size);
+    }
+}
+
+static int run_worker(int id, int nworkers, const char *handler, const char *outdir,
+                      size_t chunk_size, result_t *results) {
+    cpu_set_t cpus;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *driver_path = getenv("LOLHTML_REWRITE_DRIVER");
+    size_t i;
+    int driver;
+
+    if (ncpus > 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(id % ncpus, &cpus);
+        sched_setaffinity(0, sizeof(cpus), &cpus); /* best effort */
+    }
+
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+
+    if (luaL_loadfile(L, driver_path ? driver_path : DRIVER_PATH) != LUA_OK
+            || lua_pcall(L, 0, 1, 0) != LUA_OK) {
+        fprintf(stderr, "worker %d: %s\n", id, lua_tostring(L, -1));
+        return 1;
+    }
+    lua_pushstring(L, handler);
+    if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        fprintf(stderr, "worker %d: %s\n", id, lua_tostring(L, -1));
+        return 1;
+    }
+    /* keep the driver in the registry, the stack is reset for each file */
+    driver = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    for (i = id; i < files.len; i += nworkers) {
+        process_file(L, driver, files.paths[i], outdir, chunk_size, &results[i]);
+    }
+
+    lua_close(L);
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-j workers] [-o outdir] [-c chunk_size] [-v] handler.lua path...\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t chunk_size = 64 * 1024, i, total_bytes = 0, failures = 0;
+    const char *outdir = NULL, *handler;
+    uint64_t start, wall, total_ns = 0;
+    bool verbose = false;
+    result_t *results;
+    int opt, w, status, rc = 0;
+
+    while ((opt = getopt(argc, argv, "j:o:c:v")) != -1) {
+        switch (opt) {
+        case 'j': nworkers = atol(optarg); break;
+        case 'o': outdir = optarg; break;
+        case 'c': chunk_size = strtoul(optarg, NULL, 10); break;
+        case 'v': verbose = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2 || nworkers < 1 || chunk_size == 0) {
+        usage(argv[0]);
+    }
+    handler = argv[optind++];
+    for (; optind < argc; optind++) {
+        add_path(argv[optind]);
+    }
+    if (files.len == 0) {
+        fprintf(stderr, "no input files\n");
+        return 1;
+    }
+    if ((size_t)nworkers > files.len) {
+        nworkers = files.len;
+    }
+
+    results = mmap(NULL, files.len * sizeof(result_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    start = now_ns();
+    for (w = 0; w < nworkers; w++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        } else if (pid == 0) {
+            _exit(run_worker(w, nworkers, handler, outdir, chunk_size, results));
+        }
+    }
+    for (w = 0; w < nworkers; w++) {
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            rc = 1;
+        }
+    }
+    wall = now_ns() - start;
+
+    for (i = 0; i < files.len; i++) {
+        result_t *res = &results[i];
+        if (res->status == 0) {
+            set_error(res, "not processed (worker failed)");
+        }
+        if (res->status > 0) {
+            total_bytes += res->bytes;
+            total_ns += res->ns;
+            if (verbose) {
+                printf("ok\t%.3f ms\t%zu B\t%s\n", res->ns / 1e6, res->bytes, files.paths[i]);
+            }
+        } else {
+            failures++;
+            printf("FAIL\t%s\t%s\n", files.paths[i], res->err);
+        }
+    }
+
+    printf("%zu files, %zu failures, %zu workers\n", files.len, failures, (size_t)nworkers);
+    printf("%.2f MB in %.3f s wall time: %.2f MB/s\n",
+           total_bytes / 1e6, wall / 1e9, total_bytes / 1e6 / (wall / 1e9));
+    if (files.len > failures) {
+        printf("mean time per file: %.3f ms\n", total_ns / 1e6 / (files.len - failures));
+    }
+
+    return (rc != 0 || failures != 0) ? 1 : 0;
+}
@@ -0,0 +1,47 @@
+-- Lua side of the lolhtml-rewrite command. This file is loaded once by each
+-- worker process of the launcher (tools/lolhtml-rewrite.c), called with the
+-- path of the handler script, and must return a table with:
+--
+-- * `begin(input, output)`: prepares the rewriter for a new document and
+--   returns it, `output` is the output file path or `nil` to discard the
+--   output.
+-- * `finish()`: called after the document was closed (successfully or not).
+--
+-- The handler script must return a RewriterBuilder. The handlers are called
+-- with a context table as second argument, with the `input` and `output`
+-- fields set to the file paths.
+
+local lolhtml = require "lolhtml"
+
+return function(handler_path)
+  local builder = dofile(handler_path)
+  assert(type(builder) == "userdata", "the handler script must return a RewriterBuilder")
+
+  -- a single rewriter is reused for all documents of this worker
+  local rewriter = assert(lolhtml.new_rewriter {
+    builder = builder,
+    sink = function(s, ctx)
+      local f = ctx.file
+      if f then f:write(s) end
+    end,
+  })
+  local ctx
+
+  local driver = {}
+
+  function driver.begin(input, output)
+    ctx = { input = input, output = output }
+    if output then
+      ctx.file = assert(io.open(output, "wb"))
+    end
+    assert(rewriter:reset { context = ctx })
+    return rewriter
+  end
+
+  function driver.finish()
+    if ctx and ctx.file then ctx.file:close() end
+    ctx = nil
+  end
+
+  return driver
+end
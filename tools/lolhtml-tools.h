@@ -0,0 +1,33 @@
+/* helpers shared by lolhtml-rewrite and lolhtml-replay */
+#ifndef LOLHTML_TOOLS_H
+#define LOLHTML_TOOLS_H
+
+#include <lua.h>
+#include <stdint.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* calls rewriter:method(chunk?) with the rewriter at index 1, returns the
+ * error message on failure (left on the stack) */
+static const char *call_rewriter(lua_State *L, const char *method, const char *chunk, size_t len) {
+    lua_getfield(L, 1, method);
+    lua_pushvalue(L, 1);
+    if (chunk != NULL) {
+        lua_pushlstring(L, chunk, len);
+    }
+    if (lua_pcall(L, chunk != NULL ? 2 : 1, 2, 0) != LUA_OK) {
+        return lua_tostring(L, -1);
+    }
+    if (lua_isnil(L, -2)) {
+        return lua_isstring(L, -1) ? lua_tostring(L, -1) : "(non-string error)";
+    }
+    lua_pop(L, 2);
+    return NULL;
+}
+
+#endif